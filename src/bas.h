@@ -6,6 +6,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <limits.h>
+#include <stdint.h>
 #include <setjmp.h>
 
 #ifdef _WIN32
@@ -18,12 +20,19 @@
 #endif
 
 /* Constants */
-#define MAX_LINE_LEN 256
+#define MAX_LINE_LEN 256 /* Line editor buffer */
 #define MAX_VAR_NAME 32
-#define MAX_LINES 2000
-#define STACK_SIZE 100
-#define MAX_ARRAYS 50
+
+/* Initial capacities. These containers start out in static storage, so small
+   programs never allocate for them, and move to the heap (doubling) only when
+   a program outgrows them. */
+#define INIT_LINES 2000
+#define INIT_STACK 100
+#define INIT_ARRAYS 50
+#define INLINE_DIMS 3 /* Subscripts handled without allocating */
 #define HISTORY_SIZE 20 // Max number of commands to store in history
+#define MAX_FILES 255 /* File numbers for OPEN run from 1 to this */
+#define FILE_BUF_SIZE (1 << 20) /* Initial buffer of an OPEN file */
 
 // Special key codes for line editing
 typedef enum {
@@ -44,7 +53,7 @@ typedef enum {
     TOK_PRINT, TOK_IF, TOK_THEN, TOK_GOTO, TOK_FOR, TOK_TO, TOK_STEP, TOK_NEXT,
     TOK_REM, TOK_LET, TOK_INPUT, TOK_END, TOK_SLEEP, TOK_GOSUB, TOK_RETURN,
     TOK_DIM, TOK_RUN, TOK_LIST, TOK_NEW, TOK_BYE, TOK_CLS,
-    TOK_SIN, TOK_COS, TOK_TAN, TOK_ATN, TOK_EXP, TOK_LOG, TOK_SQR, TOK_INT, TOK_ABS, TOK_SGN, TOK_RND,
+    TOK_SIN, TOK_COS, TOK_TAN, TOK_ATN, TOK_EXP, TOK_LOG, TOK_SQR, TOK_INT, TOK_ABS, TOK_SGN, TOK_EOF_FN, TOK_LOF, TOK_RND,
     TOK_TAB, TOK_SPC, TOK_INKEY, TOK_LEN,
     TOK_ASC, TOK_CHR, TOK_MID, TOK_LEFT, TOK_RIGHT, TOK_VAL, TOK_STR,
     TOK_PLUS, TOK_MINUS, TOK_MUL, TOK_DIV, TOK_MOD,
@@ -53,105 +62,249 @@ typedef enum {
     TOK_LPAREN, TOK_RPAREN, TOK_COMMA, TOK_SEMICOLON, TOK_COLON,
     TOK_SAVE, TOK_LOAD, TOK_EDIT,
     TOK_DATA, TOK_READ, TOK_RESTORE,
-    TOK_STOP, TOK_DEF, TOK_ON
+    TOK_STOP, TOK_DEF, TOK_ON, TOK_USING,
+    TOK_OPEN, TOK_CLOSE, TOK_AS, TOK_OUTPUT, TOK_APPEND, TOK_LINE, TOK_MAPPED,
+    TOK_HASH,
+    TOK_ERROR /* Lexing error, raised when execution reaches it */
 } BasTokenType;
 
 /* Value Type */
 typedef enum {
     VAL_NUM,
-    VAL_STR
+    VAL_STR,
+    VAL_INT, /* A% variables and arrays, integer literals beyond 2^53 */
+    VAL_SNG  /* Only declared by A! names: single precision, read as VAL_NUM */
 } ValType;
 
-typedef struct {
-    ValType type;
+/* Reference-counted immutable string (str.c) */
+typedef struct String {
+    unsigned refs; /* 0: a temporary, in the temp_alloc() arena */
+    size_t len;  /* The text may contain NULs */
+    size_t cap;  /* Room for text, not counting the NUL */
+    char text[]; /* NUL-terminated */
+} String;
+
+#ifdef BAS_NAN_BOX
+/* NaN-boxed layout (make NANBOX=1): a Value is a single 64-bit word. A
+   number is stored as itself. A string is a String pointer in the low 48
+   bits of a quiet NaN carrying NAN_BOX_STR, a pattern no arithmetic
+   produces: operations on NaN hand back the default NaN or their NaN
+   operand. The one way in for a NaN with a payload is text such as
+   "NAN(0x...)" given to VAL or INPUT, and parse_number() reduces that to
+   the default NaN. This
+   assumes pointers fit in 48 bits, as on x86-64 and AArch64 user space.
+   An integer that fits in 48 bits is kept in the payload under
+   NAN_BOX_INT. A larger one is boxed, under NAN_BOX_BIG, in an 8-byte
+   String that is kept and dropped exactly like a string's. */
+
+typedef union {
     double num;
-    char *str; /* Dynamically allocated */
+    uint64_t bits;
 } Value;
 
+#define NAN_BOX_STR  0xFFFC000000000000ULL
+#define NAN_BOX_INT  0xFFFD000000000000ULL
+#define NAN_BOX_BIG  0xFFFE000000000000ULL
+#define NAN_BOX_PTR  0x0000FFFFFFFFFFFFULL
+#define VAL_TYPE(v)  ((v).bits < NAN_BOX_STR ? VAL_NUM : (v).bits < NAN_BOX_INT ? VAL_STR : VAL_INT)
+#define SET_NUM(v, x) ((v).num = (x))
+#define SET_INT(v, x) ((v) = int_make(x))
+#define INT_OF(v)    int_of(v)
+#define STORE_INT(v, x) int_store(&(v), x) /* SET_INT() on a variable's value */
+#else
+#define STR_INLINE 15 /* Longest string kept inside a Value */
+
+/* 24 bytes: the number, integer or string shares the first 16 with the
+   inline text, and the type and length follow. num is a member of the
+   outer union so that it reads v.num in both layouts. */
+typedef union {
+    double num; /* VAL_NUM */
+    struct {
+        union {
+            struct {
+                String *str;  /* One reference if the value is stored */
+                unsigned off; /* Where the characters start in str */
+            } ref;            /* len > STR_INLINE */
+            char text[STR_INLINE + 1]; /* len <= STR_INLINE, NUL-terminated */
+            int64_t i;                 /* VAL_INT */
+        } s;
+        ValType type;
+        unsigned len; /* VAL_STR: number of characters */
+    } h;
+} Value;
+
+#define VAL_TYPE(v)  ((v).h.type)
+#define SET_NUM(v, x) ((v).h.type = VAL_NUM, (v).num = (x))
+#define SET_INT(v, x) ((v).h.type = VAL_INT, (v).h.s.i = (x))
+#define INT_OF(v)    ((v).h.s.i)
+#define STORE_INT(v, x) SET_INT(v, x) /* SET_INT() on a variable's value */
+#endif
+
+/* A numeric value (VAL_NUM or VAL_INT) as a double */
+#define NUM_OF(v)    (VAL_TYPE(v) == VAL_INT ? (double)INT_OF(v) : (v).num)
+
+/* Integers up to this size are exact as doubles. A larger integer literal
+   is the one kind of literal that is evaluated as an integer (VAL_INT). */
+#define INT_EXACT_MAX ((int64_t)1 << 53)
+
+/* A pre-decoded ("crunched") token. Lines are converted to arrays of these
+   once, when they are stored, so execution never re-scans the source text. */
+typedef struct {
+    BasTokenType type;
+    unsigned hash;   /* hash_name() of a TOK_IDENTIFIER */
+    unsigned char is_int; /* A TOK_NUMBER written as an integer that fits in 64 bits */
+    double num;      /* Value of a TOK_NUMBER */
+    int64_t ival;    /* Exact value of an is_int TOK_NUMBER */
+    const char *str; /* TOK_STRING literal, interned TOK_IDENTIFIER name or TOK_ERROR message */
+    struct VmCode *code; /* Bytecode for the expression starting here, compiled on first use */
+    struct UsingPlan *plan; /* Format of a PRINT USING, on its USING token (format.c) */
+    signed char fn;  /* user_functions index of a TOK_IDENTIFIER named FNA-FNZ, else -1 */
+    int slot;        /* Variable or array slot of a TOK_IDENTIFIER, -1 until first use,
+                        or line index of a TOK_NUMBER used as a jump target */
+    unsigned target_gen; /* program_generation a jump target's 'slot' was found in */
+} Token;
+
 /* Structure for a line of BASIC code */
 typedef struct {
     int number;
-    char *text;
+    char *text;     /* Original source, kept for LIST/SAVE/EDIT */
+    Token *tokens;  /* Crunched form, terminated by TOK_EOL */
 } Line;
 
 typedef struct {
     char name[MAX_VAR_NAME];
+    unsigned hash;
+    ValType type; /* From the name: A$ VAL_STR, A% VAL_INT, A! VAL_SNG, otherwise VAL_NUM */
     Value val;
 } Variable;
 
 typedef struct {
-    char arg_name[MAX_VAR_NAME];
-    char *expr_text;
+    int arg;     /* Variable slot of the parameter */
+    Token *expr; /* First token of the body, inside the defining line */
     int defined;
 } UserFunc;
 
-/* Structure for Array */
-#define MAX_DIMS 3
+/* Structure for Array. A slot is created the first time a name is used
+   with subscripts; it holds no data until the array is DIMensioned. */
 typedef struct {
     char name[MAX_VAR_NAME];
+    unsigned hash;
     ValType type;
     int dims;                 /* Number of dimensions (1 or 2 usually) */
-    int dim_sizes[MAX_DIMS];  /* Size of each dimension */
+    int *dim_sizes;           /* Size of each dimension, NULL until DIM */
     int total_size;
-    Value *data; /* Dynamically allocated array of values */
+    double *nums;             /* Elements of a numeric array */
+    int64_t *ints;            /* Elements of an integer (%) array */
+    float *sngs;              /* Elements of a single-precision (!) array */
+    String **strs;            /* Elements of a string array, NULL reads as "" */
+    int strs_set;             /* Number of non-NULL elements in strs */
 } Array;
 
 /* Structure for loop stack */
+/* How NEXT steps a loop, decided once by FOR from the type of the control
+   variable and the sign of the step */
+typedef enum {
+    FOR_NUM_UP, FOR_NUM_DOWN, /* Double, step > 0 and step <= 0 */
+    FOR_SNG_UP, FOR_SNG_DOWN, /* Single (!), rounded to float each step */
+    FOR_INT_UP, FOR_INT_DOWN  /* Integer (%) */
+} ForKind;
+
 typedef struct {
-    char var[MAX_VAR_NAME];
+    int var; /* Slot of the control variable */
+    ForKind kind;
     double target;
     double step;
-    int line_idx; /* Index in the 'lines' array */
-    char *resume_ptr; /* Pointer into the line text to resume execution */
+    int64_t itarget; /* target and step of an integer (%) control variable */
+    int64_t istep;
+    int line_idx; /* Index in the 'lines' array of the first body statement */
+    Token *resume_ptr; /* First token of the body */
 } ForLoop;
 
+/* A file OPENed by the program. Reads and writes go through buf, so the
+   file is read and written in blocks of FILE_BUF_SIZE or more. */
+typedef struct {
+    FILE *fp;       /* NULL if the file number is not in use */
+    int output;     /* Opened FOR OUTPUT or APPEND */
+    int mapped;     /* buf is the whole file, mapped into memory */
+    char *buf;
+    size_t cap;
+    size_t pos;     /* Input: next unread byte in buf */
+    size_t len;     /* Input: end of the data in buf; output: bytes waiting */
+    int at_end;     /* Input: everything has been read into buf */
+    double size;    /* Length of the file, for LOF */
+    int column;     /* Output: column for TAB and commas in PRINT # */
+} FileChannel;
+
 /* Structure for GOSUB stack */
 typedef struct {
     int line_idx;
 } GosubFrame;
 
 /* Global State */
-extern Line program[MAX_LINES];
+extern Line *program;
 extern int program_line_count;
-extern Variable variables[100]; /* Simple symbol table */
+extern int program_cap;
+extern unsigned program_generation; /* Bumped whenever lines are added or removed */
+extern Variable *variables; /* Scalar variable slots, indexed by a hash table in var.c */
 extern int var_count;
-extern Array arrays[MAX_ARRAYS];
+extern Array *arrays;
 extern int array_count;
 extern UserFunc user_functions[26];
-extern ForLoop for_stack[STACK_SIZE];
+extern ForLoop *for_stack;
 extern int for_sp;
-extern GosubFrame gosub_stack[STACK_SIZE];
+extern int for_cap;
+extern GosubFrame *gosub_stack;
 extern int gosub_sp;
+extern int gosub_cap;
 extern int current_line_idx; /* Program Counter (index in program array) */
 extern int execution_finished;
 
-extern char *jump_to_ptr; /* If non-NULL, resume execution from here instead of start of line */
+extern Token *jump_to_ptr; /* If non-NULL, resume execution from here instead of start of line */
 
 extern jmp_buf error_jmp;
 extern int interactive_mode_active;
+extern int vm_enabled; /* Evaluate expressions with the bytecode VM (0: tree-walker, --tree) */
 
 /* Data Pointer State */
 extern int data_line_idx;
-extern char *data_ptr;
+extern Token *data_ptr;
 
 /* Lexer State */
-extern char *token_ptr;
+extern Token *token_ptr;
 extern BasTokenType current_token;
 extern double token_number;
-extern char token_string[MAX_LINE_LEN];
+extern const char *token_string;
+extern Token *token_cur; /* Token current_token was loaded from */
 
 /* Prototypes */
 void load_program(const char *filename);
-void sort_program(void);
 void run_program(void);
 
 /* Tokenizer */
 void next_token(void);
-void init_tokenizer(char *line);
+Token *crunch_line(const char *text);
+Token *crunch_input(const char *text);
+void free_tokens(Token *tokens);
+void init_tokenizer(Token *tokens);
+void bench_lexer(int nfiles, char **files);
 int match(BasTokenType t);
 
 /* Expression Evaluator */
 Value expression(void);
+Value apply_binary(BasTokenType op, Value left, Value right);
+Value apply_unary(BasTokenType op, Value val);
+Value apply_builtin(BasTokenType func, Value *args, int nargs);
+Value load_element(Token *name, Value *args, int nargs);
+int64_t int_value(Value v);
+int int_mul_overflows(int64_t a, int64_t b);
+int index_value(Value v);
+
+enum { SFN_LPAREN, SFN_COMMA, SFN_RPAREN };
+const char *string_fn_message(BasTokenType func, int which);
+
+/* Bytecode VM */
+Value vm_expression(void);
+void vm_free_code(struct VmCode *code);
 
 /* Execution */
 void exec_statement(void);
@@ -168,17 +321,76 @@ void cmd_return(void);
 void cmd_files(void);
 void cmd_chdir(void);
 void cmd_end(void);
+void cmd_open(void);
+void cmd_close(void);
+void cmd_line(void);
+void close_files(void);
+double file_eof(int n);
+double file_lof(int n);
 
 /* Variables */
-Value get_var(const char *name);
-void set_var(const char *name, Value val);
+int resolve_var(Token *tok);
+Value get_var(int slot);
+void set_var(int slot, Value val);
+void append_var(int slot, Value val);
+void clear_variables(void);
+
+/* Strings */
+String *str_new(const char *text, size_t len);
+String *str_ref(String *s);
+void str_unref(String *s);
+Value str_make(const char *text, size_t len);
+Value str_share(String *s);
+const char *str_data(const Value *v);
+size_t str_len(const Value *v);
+Value str_slice(Value v, size_t start, size_t len);
+String *str_detach(Value v);
+Value str_concat(Value a, Value b);
+void str_append(Value *v, const char *text, size_t len);
+int str_compare(const Value *a, const Value *b);
+double str_to_num(const Value *v);
+double parse_number(const char *text, size_t len);
+Value keep_value(Value v);
+void drop_value(Value v);
+#ifdef BAS_NAN_BOX
+Value int_make(int64_t i);
+int64_t int_of(Value v);
+void int_store(Value *v, int64_t i);
+#endif
 
 /* Arrays */
-Value *get_array_ptr(const char *name, int dims, int *indices);
-void create_array(const char *name, int dims, int *sizes);
+int resolve_array(Token *tok);
+double *array_num_ptr(int slot, int dims, int *indices);
+int64_t *array_int_ptr(int slot, int dims, int *indices);
+float *array_sng_ptr(int slot, int dims, int *indices);
+String *array_str_get(int slot, int dims, int *indices);
+void array_str_set(int slot, int dims, int *indices, String *str);
+void create_array(int slot, int dims, int *sizes);
+void clear_arrays(void);
+
+/* Output (out.c) */
+void out_write(const char *text, size_t len);
+void out_char(char c);
+void out_spaces(int n);
+void out_newline(void);
+void out_flush(void);
+
+/* Number formatting (format.c) */
+int format_number(double x, char *buf);
+int format_value(Value v, char *buf);
+struct UsingPlan *using_plan(struct UsingPlan *cached, const char *format, size_t len);
+void using_free(struct UsingPlan *plan);
+typedef void (*TextSink)(const char *text, size_t len);
+int using_text(struct UsingPlan *plan, TextSink write);
+int using_field(struct UsingPlan *plan, Value v, TextSink write);
+void bench_format(void);
 
 /* Utils */
 void error(const char *msg);
+void *grow_storage(void *items, int *cap, int initial_cap, size_t item_size);
+void *temp_alloc(size_t size);
+void temp_reset(void);
+char *read_line(FILE *fp, char **buf, size_t *cap);
 int find_line_index(int line_num);
 
 /* Platform IO */
@@ -190,6 +402,6 @@ void clear_current_line(int prompt_len, int current_len);
 void print_line_buffer(const char *prompt, const char *buffer, int cursor_pos);
 
 /* Utils */
-void ensure_extension(char *filename);
+char *with_extension(const char *filename);
 
 #endif
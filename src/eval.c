@@ -10,7 +10,419 @@ Value additive(void);
 Value term(void);
 Value factor(void);
 
+/*
+ * Operator and function semantics.
+ * These are shared by the tree-walking evaluator below and the bytecode VM
+ * (vm.c), so both engines produce identical results and error messages.
+ * Every helper takes ownership of the strings in the values passed to it.
+ */
+
+/* Whether a * b would overflow 64 bits */
+int int_mul_overflows(int64_t a, int64_t b) {
+    if (a == 0 || b == 0) return 0;
+    if (a > 0) return b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a;
+    return b > 0 ? a < INT64_MIN / b : b < INT64_MAX / a;
+}
+
+/* op on two integers, into *res. Returns 0 if op has no integer form or
+   the result would overflow, and the caller works in floating point. */
+static int int_binary(BasTokenType op, int64_t a, int64_t b, Value *res) {
+    switch (op) {
+        case TOK_PLUS:
+            if (b > 0 ? a > INT64_MAX - b : a < INT64_MIN - b) return 0;
+            SET_INT(*res, a + b);
+            return 1;
+        case TOK_MINUS:
+            if (b < 0 ? a > INT64_MAX + b : a < INT64_MIN + b) return 0;
+            SET_INT(*res, a - b);
+            return 1;
+        case TOK_MUL:
+            if (int_mul_overflows(a, b)) return 0;
+            SET_INT(*res, a * b);
+            return 1;
+        case TOK_MOD:
+            if (b == 0) error("Division by zero");
+            SET_INT(*res, b == -1 ? 0 : a % b);
+            return 1;
+        case TOK_EQ: SET_NUM(*res, (a == b) ? -1.0 : 0.0); return 1;
+        case TOK_NE: SET_NUM(*res, (a != b) ? -1.0 : 0.0); return 1;
+        case TOK_LT: SET_NUM(*res, (a < b) ? -1.0 : 0.0); return 1;
+        case TOK_GT: SET_NUM(*res, (a > b) ? -1.0 : 0.0); return 1;
+        case TOK_LE: SET_NUM(*res, (a <= b) ? -1.0 : 0.0); return 1;
+        case TOK_GE: SET_NUM(*res, (a >= b) ? -1.0 : 0.0); return 1;
+        default: return 0;
+    }
+}
+
+/* x truncated to an integer, which must fit in 64 bits */
+static int64_t trunc_int64(double x) {
+    x = trunc(x);
+    if (!(x >= -9223372036854775808.0 && x < 9223372036854775808.0)) error("Overflow");
+    return (int64_t)x;
+}
+
+/* v as an integer operand: an integer, or a whole number in 64-bit range */
+static int int_operand(Value v, int64_t *i) {
+    if (VAL_TYPE(v) == VAL_INT) {
+        *i = INT_OF(v);
+        return 1;
+    }
+    if (VAL_TYPE(v) == VAL_NUM && v.num == trunc(v.num) &&
+        v.num >= -9223372036854775808.0 && v.num < 9223372036854775808.0) {
+        *i = (int64_t)v.num;
+        return 1;
+    }
+    return 0;
+}
+
+Value apply_binary(BasTokenType op, Value left, Value right) {
+    /* An integer stays an integer when the other side is one too, or a
+       whole number (so I% + 1 is integer arithmetic); otherwise (and on
+       overflow) the integer side is converted and the operator works on
+       numbers as usual. Two numbers are never worked on as integers. */
+    if (VAL_TYPE(left) == VAL_INT || VAL_TYPE(right) == VAL_INT) {
+        int64_t a, b;
+        if (int_operand(left, &a) && int_operand(right, &b) &&
+            int_binary(op, a, b, &left)) {
+            return left;
+        }
+        if (VAL_TYPE(left) == VAL_INT) SET_NUM(left, (double)INT_OF(left));
+        if (VAL_TYPE(right) == VAL_INT) SET_NUM(right, (double)INT_OF(right));
+    }
+
+    switch (op) {
+        case TOK_OR:
+        case TOK_AND:
+            if (VAL_TYPE(left) == VAL_NUM && VAL_TYPE(right) == VAL_NUM) {
+                /* BASIC uses truthy/falsy logic. 0 is false, !=0 is true (usually -1 for built-ins).
+                   MS BASIC uses bitwise integer operations; for this simple interpreter
+                   we stick to logical boolean results (-1/0) for flow control.
+                */
+                int l = (left.num != 0);
+                int r = (right.num != 0);
+                if (op == TOK_OR) left.num = (l || r) ? -1.0 : 0.0;
+                else left.num = (l && r) ? -1.0 : 0.0;
+            } else {
+                error(op == TOK_OR ? "Type mismatch in OR" : "Type mismatch in AND");
+            }
+            return left;
+
+        case TOK_EQ: case TOK_NE: case TOK_LT:
+        case TOK_GT: case TOK_LE: case TOK_GE:
+            if (VAL_TYPE(left) == VAL_NUM && VAL_TYPE(right) == VAL_NUM) {
+                double res = 0.0;
+                switch (op) {
+                    case TOK_EQ: res = (left.num == right.num) ? -1.0 : 0.0; break;
+                    case TOK_NE: res = (left.num != right.num) ? -1.0 : 0.0; break;
+                    case TOK_LT: res = (left.num < right.num) ? -1.0 : 0.0; break;
+                    case TOK_GT: res = (left.num > right.num) ? -1.0 : 0.0; break;
+                    case TOK_LE: res = (left.num <= right.num) ? -1.0 : 0.0; break;
+                    case TOK_GE: res = (left.num >= right.num) ? -1.0 : 0.0; break;
+                    default: break;
+                }
+                left.num = res;
+            } else if (VAL_TYPE(left) == VAL_STR && VAL_TYPE(right) == VAL_STR) {
+                int cmp = str_compare(&left, &right);
+                double res = 0.0;
+                switch (op) {
+                    case TOK_EQ: res = (cmp == 0) ? -1.0 : 0.0; break;
+                    case TOK_NE: res = (cmp != 0) ? -1.0 : 0.0; break;
+                    case TOK_LT: res = (cmp < 0) ? -1.0 : 0.0; break;
+                    case TOK_GT: res = (cmp > 0) ? -1.0 : 0.0; break;
+                    case TOK_LE: res = (cmp <= 0) ? -1.0 : 0.0; break;
+                    case TOK_GE: res = (cmp >= 0) ? -1.0 : 0.0; break;
+                    default: break;
+                }
+                /* Result of comparison is always a number */
+                SET_NUM(left, res);
+            } else {
+                error("Type mismatch in comparison");
+            }
+            return left;
+
+        case TOK_PLUS:
+            if (VAL_TYPE(left) == VAL_NUM && VAL_TYPE(right) == VAL_NUM) {
+                left.num += right.num;
+            } else if (VAL_TYPE(left) == VAL_STR && VAL_TYPE(right) == VAL_STR) {
+                left = str_concat(left, right);
+            } else {
+                error("Type mismatch in addition");
+            }
+            return left;
+
+        case TOK_MINUS:
+            if (VAL_TYPE(left) == VAL_NUM && VAL_TYPE(right) == VAL_NUM) {
+                left.num -= right.num;
+            } else {
+                error("Type mismatch in subtraction");
+            }
+            return left;
+
+        case TOK_MUL: case TOK_DIV: case TOK_MOD:
+            if (VAL_TYPE(left) == VAL_NUM && VAL_TYPE(right) == VAL_NUM) {
+                if (op == TOK_MUL) left.num *= right.num;
+                else if (op == TOK_DIV) {
+                    if (right.num == 0.0) error("Division by zero");
+                    left.num /= right.num;
+                } else {
+                    /* MOD works on both sides truncated to integers */
+                    int64_t l = trunc_int64(left.num), r = trunc_int64(right.num);
+                    if (r == 0) error("Division by zero");
+                    left.num = (r == -1) ? 0.0 : (double)(l % r);
+                }
+            } else {
+                error("Type mismatch in multiplication/division");
+            }
+            return left;
+
+        default:
+            error("Unknown operator");
+            return left;
+    }
+}
+
+Value apply_unary(BasTokenType op, Value val) {
+    if (VAL_TYPE(val) == VAL_INT) {
+        if (op == TOK_MINUS && INT_OF(val) != INT64_MIN) {
+            SET_INT(val, -INT_OF(val));
+            return val;
+        }
+        SET_NUM(val, (double)INT_OF(val));
+    }
+    if (op == TOK_NOT) {
+        if (VAL_TYPE(val) == VAL_NUM) {
+             val.num = (val.num == 0.0) ? -1.0 : 0.0;
+        } else {
+             error("Type mismatch in NOT");
+        }
+    } else {
+        if (VAL_TYPE(val) == VAL_NUM) val.num = -val.num;
+        else error("Type mismatch for unary minus");
+    }
+    return val;
+}
+
+/* Index of the defined user function (FNA-FNZ) a name token calls, or -1.
+   The lexer has already worked out which function the name would be. */
+static int user_fn_index(const Token *name) {
+    if (name->fn >= 0 && user_functions[(int)name->fn].defined) return name->fn;
+    return -1;
+}
+
+static Value call_user_fn(int fn_idx, Value varg) {
+    Value val;
+
+    /* Save Parser State */
+    Token *save_token_ptr = token_ptr;
+    BasTokenType save_token = current_token;
+    double save_num = token_number;
+    const char *save_str = token_string;
+    Token *save_cur = token_cur;
+
+    /* Save Arg Var, with a reference of its own while it is replaced */
+    UserFunc *fn = &user_functions[fn_idx];
+    Value old_val = keep_value(get_var(fn->arg));
+
+    /* Set Arg Var */
+    set_var(fn->arg, varg);
+
+    /* Execute Expression. The result may borrow the argument's string (or
+       boxed integer), which is released below, so it gets a copy. */
+    init_tokenizer(fn->expr);
+    val = expression();
+    if (VAL_TYPE(val) == VAL_STR) val = str_make(str_data(&val), str_len(&val));
+    else if (VAL_TYPE(val) == VAL_INT) SET_INT(val, INT_OF(val));
+
+    /* Restore Arg Var */
+    set_var(fn->arg, old_val);
+    drop_value(old_val);
+
+    /* Restore Parser State */
+    token_ptr = save_token_ptr;
+    current_token = save_token;
+    token_number = save_num;
+    token_string = save_str;
+    token_cur = save_cur;
+    return val;
+}
+
+/* Integer subscripts for load_element(). Every argument has been evaluated
+   before they are filled in, so one buffer is enough. */
+static int element_indices_init[INLINE_DIMS];
+static int *element_indices = element_indices_init;
+static int element_indices_cap = INLINE_DIMS;
+
+/* NAME(args): a call of a defined FN, otherwise an array element read */
+Value load_element(Token *name, Value *args, int nargs) {
+    Value val;
+    int *indices;
+    int fn_idx = user_fn_index(name);
+    int slot, d;
+
+    if (fn_idx >= 0) {
+        if (nargs != 1) error("Expected ')' for FN");
+        return call_user_fn(fn_idx, args[0]);
+    }
+
+    while (nargs > element_indices_cap) {
+        element_indices = grow_storage(element_indices, &element_indices_cap, INLINE_DIMS, sizeof(int));
+    }
+    indices = element_indices;
+    for (d = 0; d < nargs; d++) {
+        if (VAL_TYPE(args[d]) == VAL_STR) error("Array index must be number");
+        indices[d] = index_value(args[d]);
+    }
+
+    slot = resolve_array(name);
+    if (arrays[slot].type == VAL_STR) {
+        val = str_share(array_str_get(slot, nargs, indices));
+    } else if (arrays[slot].type == VAL_INT) {
+        SET_INT(val, *array_int_ptr(slot, nargs, indices));
+    } else if (arrays[slot].type == VAL_SNG) {
+        SET_NUM(val, *array_sng_ptr(slot, nargs, indices));
+    } else {
+        SET_NUM(val, *array_num_ptr(slot, nargs, indices));
+    }
+    return val;
+}
+
+/* A number as an integer, for an A% variable or array element: rounded to
+   the nearest, halves away from zero */
+int64_t int_value(Value v) {
+    double n;
+    if (VAL_TYPE(v) == VAL_INT) return INT_OF(v);
+    n = round(v.num);
+    if (!(n >= -9223372036854775808.0 && n < 9223372036854775808.0)) error("Overflow");
+    return (int64_t)n;
+}
+
+/* A number as an array subscript: truncated. An integer beyond the range
+   of int becomes -1 (out of bounds) instead of wrapping around. */
+int index_value(Value v) {
+    if (VAL_TYPE(v) == VAL_INT) {
+        return (INT_OF(v) < 0 || INT_OF(v) > INT_MAX) ? -1 : (int)INT_OF(v);
+    }
+    return (int)v.num;
+}
+
+Value apply_builtin(BasTokenType func, Value *args, int nargs) {
+    Value val;
+    Value v;
+    int i;
+    SET_NUM(val, 0.0);
+    /* The functions work on numbers, except STR$, which shows an integer
+       with all its digits */
+    for (i = 0; i < nargs; i++) {
+        if (VAL_TYPE(args[i]) == VAL_INT && func != TOK_STR) SET_NUM(args[i], (double)INT_OF(args[i]));
+    }
+    v = (nargs > 0) ? args[0] : val;
+
+    switch (func) {
+        case TOK_INKEY: {
+            char key = (char)read_key();
+            val = str_make(&key, key != 0);
+            break;
+        }
+        case TOK_LEN:
+            if (VAL_TYPE(v) != VAL_STR) error("LEN expects string");
+            val.num = (double)str_len(&v);
+            break;
+        case TOK_ASC:
+            if (VAL_TYPE(v) != VAL_STR) error("ASC expects string");
+            val.num = str_len(&v) ? (double)(unsigned char)str_data(&v)[0] : 0.0;
+            break;
+        case TOK_CHR: {
+            char c;
+            if (VAL_TYPE(v) != VAL_NUM) error("CHR$ expects number");
+            c = (char)v.num;
+            val = str_make(&c, 1);
+            break;
+        }
+        case TOK_VAL:
+            if (VAL_TYPE(v) != VAL_STR) error("VAL expects string");
+            val.num = str_to_num(&v);
+            break;
+        case TOK_STR: {
+            char buf[32];
+            if (VAL_TYPE(v) == VAL_STR) error("STR$ expects number");
+            val = str_make(buf, format_value(v, buf));
+            break;
+        }
+        case TOK_MID: {
+            int start, len = -1, slen;
+            if (VAL_TYPE(v) != VAL_STR) error("MID$ expects string");
+            if (VAL_TYPE(args[1]) != VAL_NUM) error("MID$ start expects number");
+            start = (int)args[1].num;
+            if (nargs > 2) {
+                 if (VAL_TYPE(args[2]) != VAL_NUM) error("MID$ length expects number");
+                 len = (int)args[2].num;
+            }
+
+            slen = (int)str_len(&v);
+            if (start < 1) start = 1; /* BASIC is 1-based usually */
+            start--; /* 0-based for C */
+            if (start >= slen) {
+                 val = str_slice(v, 0, 0);
+            } else {
+                 if (len == -1 || start + len > slen) len = slen - start;
+                 if (len < 0) len = 0;
+                 val = str_slice(v, start, len);
+            }
+            break;
+        }
+        case TOK_LEFT:
+        case TOK_RIGHT: {
+            int len, slen;
+            if (VAL_TYPE(v) != VAL_STR) error(func == TOK_LEFT ? "LEFT$ expects string" : "RIGHT$ expects string");
+            if (VAL_TYPE(args[1]) != VAL_NUM) error(func == TOK_LEFT ? "LEFT$ length expects number" : "RIGHT$ length expects number");
+            len = (int)args[1].num;
+
+            slen = (int)str_len(&v);
+            if (len > slen) len = slen;
+            if (len < 0) len = 0;
+            if (func == TOK_LEFT) val = str_slice(v, 0, len);
+            else val = str_slice(v, slen - len, len);
+            break;
+        }
+        default:
+            /* SIN .. RND */
+            val = v;
+            if (VAL_TYPE(val) != VAL_NUM) error("Function expects number");
+
+            switch (func) {
+                case TOK_SIN: val.num = sin(val.num); break;
+                case TOK_COS: val.num = cos(val.num); break;
+                case TOK_TAN: val.num = tan(val.num); break;
+                case TOK_ATN: val.num = atan(val.num); break;
+                case TOK_EXP: val.num = exp(val.num); break;
+                case TOK_LOG:
+                    if (val.num <= 0) error("Log of non-positive number");
+                    val.num = log(val.num);
+                    break;
+                case TOK_SQR:
+                    if (val.num < 0) error("Sqrt of negative number");
+                    val.num = sqrt(val.num);
+                    break;
+                case TOK_INT: val.num = floor(val.num); break;
+                case TOK_ABS: val.num = fabs(val.num); break;
+                case TOK_SGN: val.num = (val.num > 0) ? 1 : ((val.num < 0) ? -1 : 0); break;
+                case TOK_EOF_FN: val.num = file_eof(index_value(val)); break;
+                case TOK_LOF: val.num = file_lof(index_value(val)); break;
+                case TOK_RND: val.num = ((double)rand() / ((double)RAND_MAX + 1.0)); break;
+                default: break;
+            }
+            break;
+    }
+    return val;
+}
+
+/*
+ * Tree-walking evaluator: parses the token stream and evaluates as it goes.
+ * Used when the VM is disabled (--tree) and as the reference for vm.c.
+ */
+
 Value expression(void) {
+    if (vm_enabled) return vm_expression();
     return logical_or();
 }
 
@@ -18,21 +430,7 @@ Value logical_or(void) {
     Value left = logical_and();
     while (current_token == TOK_OR) {
         next_token();
-        Value right = logical_and();
-        if (left.type == VAL_NUM && right.type == VAL_NUM) {
-            /* BASIC uses truthy/falsy logic. 0 is false, !=0 is true (usually -1 for built-ins).
-               A OR B is true if A!=0 or B!=0. Result -1.
-               Or bitwise? Standard BASIC behavior varies.
-               MS BASIC: bitwise integer operations.
-               For this simple interpreter, let's stick to logical boolean results (-1/0).
-               Or bitwise if integer? Let's assume boolean for flow control.
-            */
-             int l = (left.num != 0);
-             int r = (right.num != 0);
-             left.num = (l || r) ? -1.0 : 0.0;
-        } else {
-             error("Type mismatch in OR");
-        }
+        left = apply_binary(TOK_OR, left, logical_and());
     }
     return left;
 }
@@ -41,14 +439,7 @@ Value logical_and(void) {
     Value left = logical_not();
     while (current_token == TOK_AND) {
         next_token();
-        Value right = logical_not();
-        if (left.type == VAL_NUM && right.type == VAL_NUM) {
-             int l = (left.num != 0);
-             int r = (right.num != 0);
-             left.num = (l && r) ? -1.0 : 0.0;
-        } else {
-             error("Type mismatch in AND");
-        }
+        left = apply_binary(TOK_AND, left, logical_not());
     }
     return left;
 }
@@ -56,13 +447,8 @@ Value logical_and(void) {
 Value logical_not(void) {
     if (current_token == TOK_NOT) {
         next_token();
-        Value val = logical_not(); /* Recursive for NOT NOT A */
-        if (val.type == VAL_NUM) {
-             val.num = (val.num == 0.0) ? -1.0 : 0.0;
-        } else {
-             error("Type mismatch in NOT");
-        }
-        return val;
+        /* Recursive for NOT NOT A */
+        return apply_unary(TOK_NOT, logical_not());
     }
     return relation();
 }
@@ -73,42 +459,8 @@ Value relation(void) {
            current_token == TOK_LT || current_token == TOK_GT ||
            current_token == TOK_LE || current_token == TOK_GE) {
         BasTokenType op = current_token;
-        Value right;
         next_token();
-        right = additive();
-        
-        if (left.type == VAL_NUM && right.type == VAL_NUM) {
-            double res = 0.0;
-            switch (op) {
-                case TOK_EQ: res = (left.num == right.num) ? -1.0 : 0.0; break;
-                case TOK_NE: res = (left.num != right.num) ? -1.0 : 0.0; break;
-                case TOK_LT: res = (left.num < right.num) ? -1.0 : 0.0; break;
-                case TOK_GT: res = (left.num > right.num) ? -1.0 : 0.0; break;
-                case TOK_LE: res = (left.num <= right.num) ? -1.0 : 0.0; break;
-                case TOK_GE: res = (left.num >= right.num) ? -1.0 : 0.0; break;
-                default: break;
-            }
-            left.num = res;
-        } else if (left.type == VAL_STR && right.type == VAL_STR) {
-            int cmp = strcmp(left.str, right.str);
-            double res = 0.0;
-            switch (op) {
-                case TOK_EQ: res = (cmp == 0) ? -1.0 : 0.0; break;
-                case TOK_NE: res = (cmp != 0) ? -1.0 : 0.0; break;
-                case TOK_LT: res = (cmp < 0) ? -1.0 : 0.0; break;
-                case TOK_GT: res = (cmp > 0) ? -1.0 : 0.0; break;
-                case TOK_LE: res = (cmp <= 0) ? -1.0 : 0.0; break;
-                case TOK_GE: res = (cmp >= 0) ? -1.0 : 0.0; break;
-                default: break;
-            }
-            /* Result of comparison is always a number */
-            if (left.str) free(left.str);
-            if (right.str) free(right.str);
-            left.type = VAL_NUM;
-            left.num = res;
-        } else {
-            error("Type mismatch in comparison");
-        }
+        left = apply_binary(op, left, additive());
     }
     return left;
 }
@@ -117,31 +469,8 @@ Value additive(void) {
     Value left = term();
     while (current_token == TOK_PLUS || current_token == TOK_MINUS) {
         BasTokenType op = current_token;
-        Value right;
         next_token();
-        right = term();
-        
-        if (op == TOK_PLUS) {
-            if (left.type == VAL_NUM && right.type == VAL_NUM) {
-                left.num += right.num;
-            } else if (left.type == VAL_STR && right.type == VAL_STR) {
-                /* String concatenation */
-                char *new_str = malloc(strlen(left.str) + strlen(right.str) + 1);
-                strcpy(new_str, left.str);
-                strcat(new_str, right.str);
-                free(left.str);
-                free(right.str);
-                left.str = new_str;
-            } else {
-                error("Type mismatch in addition");
-            }
-        } else {
-            if (left.type == VAL_NUM && right.type == VAL_NUM) {
-                left.num -= right.num;
-            } else {
-                error("Type mismatch in subtraction");
-            }
-        }
+        left = apply_binary(op, left, term());
     }
     return left;
 }
@@ -150,116 +479,92 @@ Value term(void) {
     Value left = factor();
     while (current_token == TOK_MUL || current_token == TOK_DIV || current_token == TOK_MOD) {
         BasTokenType op = current_token;
-        Value right;
         next_token();
-        right = factor();
-        
-        if (left.type == VAL_NUM && right.type == VAL_NUM) {
-            if (op == TOK_MUL) left.num *= right.num;
-            else if (op == TOK_DIV) {
-                if (right.num == 0.0) error("Division by zero");
-                left.num /= right.num;
-            } else {
-                if (right.num == 0.0) error("Division by zero");
-                left.num = (int)left.num % (int)right.num;
-            }
-        } else {
-            error("Type mismatch in multiplication/division");
-        }
+        left = apply_binary(op, left, factor());
     }
     return left;
 }
 
+/* Syntax error messages for the string functions (TOK_LEN .. TOK_STR),
+   indexed by SFN_LPAREN / SFN_COMMA / SFN_RPAREN. Shared with vm.c. */
+const char *string_fn_message(BasTokenType func, int which) {
+    static const char *const msgs[][3] = {
+        {"Expected '(' for LEN", NULL, "Missing ')' for LEN"},
+        {"Expected '(' for ASC", NULL, "Missing ')' for ASC"},
+        {"Expected '(' for CHR$", NULL, "Missing ')' for CHR$"},
+        {"Expected '(' for MID$", "Expected ',' for MID$", "Missing ')' for MID$"},
+        {"Expected '(' for LEFT$", "Expected ',' for LEFT$", "Missing ')' for LEFT$"},
+        {"Expected '(' for RIGHT$", "Expected ',' for RIGHT$", "Missing ')' for RIGHT$"},
+        {"Expected '(' for VAL", NULL, "Missing ')' for VAL"},
+        {"Expected '(' for STR$", NULL, "Missing ')' for STR$"}
+    };
+    return msgs[func - TOK_LEN][which];
+}
+
+/* Parse "( arg, arg, ... " for a string function; the ')' is checked by the caller */
+static int string_fn_args(BasTokenType func, Value *args) {
+    int nargs = 0;
+
+    if (!match(TOK_LPAREN)) error(string_fn_message(func, SFN_LPAREN));
+    args[nargs++] = expression();
+    if (func == TOK_MID || func == TOK_LEFT || func == TOK_RIGHT) {
+        if (!match(TOK_COMMA)) error(string_fn_message(func, SFN_COMMA));
+        args[nargs++] = expression();
+        if (func == TOK_MID && current_token == TOK_COMMA) {
+            next_token();
+            args[nargs++] = expression();
+        }
+    }
+    return nargs;
+}
+
 Value factor(void) {
     Value val;
-    val.type = VAL_NUM;
-    val.num = 0.0;
-    
+    SET_NUM(val, 0.0);
+
     if (current_token == TOK_NUMBER) {
-        val.type = VAL_NUM;
-        val.num = token_number;
+        if (token_cur->is_int && token_cur->ival > INT_EXACT_MAX) SET_INT(val, token_cur->ival);
+        else SET_NUM(val, token_number);
         next_token();
     } else if (current_token == TOK_STRING) {
-        val.type = VAL_STR;
-        val.str = malloc(strlen(token_string) + 1);
-        strcpy(val.str, token_string);
+        val = str_make(token_string, strlen(token_string));
         next_token();
     } else if (current_token == TOK_IDENTIFIER) {
-        char var_name[MAX_VAR_NAME];
-        strcpy(var_name, token_string);
-        
+        Token *var_tok = token_cur;
+
         /* Check if User Function is defined */
-        int is_fn = 0;
-        int fn_idx = -1;
-        if (strncmp(var_name, "FN", 2) == 0 && strlen(var_name) == 3) {
-             fn_idx = toupper(var_name[2]) - 'A';
-             if (fn_idx >= 0 && fn_idx <= 25 && user_functions[fn_idx].defined) {
-                 is_fn = 1;
-             }
-        }
-        
+        int is_fn = (user_fn_index(var_tok) >= 0);
+
         next_token();
-        
+
         if (current_token == TOK_LPAREN) {
+            Value args_init[INLINE_DIMS];
+            Value *args = args_init;
+            int nargs = 0, args_cap = INLINE_DIMS;
+
+            next_token();
             if (is_fn) {
                  /* Handle User Function Call */
-                 next_token();
-                 Value varg = expression();
+                 args[nargs++] = expression();
                  if (!match(TOK_RPAREN)) error("Expected ')' for FN");
-                 
-                 /* Save Parser State */
-                 char *save_token_ptr = token_ptr;
-                 BasTokenType save_token = current_token;
-                 double save_num = token_number;
-                 char save_str[MAX_LINE_LEN];
-                 strcpy(save_str, token_string);
-                 
-                 /* Save Arg Var */
-                 Value old_val = get_var(user_functions[fn_idx].arg_name);
-                 
-                 /* Set Arg Var */
-                 set_var(user_functions[fn_idx].arg_name, varg);
-                 
-                 /* Execute Expression */
-                 init_tokenizer(user_functions[fn_idx].expr_text);
-                 val = expression();
-                 
-                 /* Restore Arg Var */
-                 set_var(user_functions[fn_idx].arg_name, old_val);
-                 
-                 /* Restore Parser State */
-                 token_ptr = save_token_ptr;
-                 current_token = save_token;
-                 token_number = save_num;
-                 strcpy(token_string, save_str);
             } else {
                 /* Array access */
-                int indices[MAX_DIMS];
-                int dims = 0;
-                
-                next_token();
                 do {
-                    if (dims >= MAX_DIMS) error("Too many subscripts");
-                    Value v = expression();
-                    if (v.type != VAL_NUM) error("Array index must be number");
-                    indices[dims++] = (int)v.num;
+                    if (nargs == args_cap) {
+                        args = grow_storage(args, &args_cap, INLINE_DIMS, sizeof(Value));
+                    }
+                    args[nargs] = expression();
+                    if (VAL_TYPE(args[nargs]) == VAL_STR) error("Array index must be number");
+                    nargs++;
                 } while (match(TOK_COMMA));
 
                 if (!match(TOK_RPAREN)) error("Expected ')'");
-                
-                Value *ptr = get_array_ptr(var_name, dims, indices);
-                if (ptr) {
-                     val = *ptr;
-                     if (val.type == VAL_STR && val.str) {
-                         char *copy = malloc(strlen(val.str) + 1);
-                         strcpy(copy, val.str);
-                         val.str = copy;
-                     }
-                }
             }
+            val = load_element(var_tok, args, nargs);
+            if (args != args_init) free(args);
         } else {
             /* Normal variable */
-            val = get_var(var_name);
+            val = get_var(resolve_var(var_tok));
         }
     } else if (current_token == TOK_LPAREN) {
         next_token();
@@ -267,166 +572,29 @@ Value factor(void) {
         if (!match(TOK_RPAREN)) error("Missing ')'");
     } else if (current_token == TOK_MINUS) {
         next_token();
-        val = factor();
-        if (val.type == VAL_NUM) val.num = -val.num;
-        else error("Type mismatch for unary minus");
+        val = apply_unary(TOK_MINUS, factor());
     } else if (current_token == TOK_PLUS) {
         next_token();
         val = factor(); /* Unary plus, do nothing */
     } else if (current_token == TOK_INKEY) {
         next_token(); /* Consume INKEY$ */
-        int key_code = read_key();
-        val.type = VAL_STR;
-        val.str = malloc(2); // For a single character + null terminator
-        val.str[0] = (char)key_code;
-        val.str[1] = '\0';
-    } else if (current_token == TOK_LEN) {
-        next_token();
-        if (!match(TOK_LPAREN)) error("Expected '(' for LEN");
-        Value v = expression();
-        if (v.type != VAL_STR) error("LEN expects string");
-        val.type = VAL_NUM;
-        val.num = (double)strlen(v.str);
-        free(v.str);
-        if (!match(TOK_RPAREN)) error("Missing ')' for LEN");
-    } else if (current_token == TOK_ASC) {
-        next_token();
-        if (!match(TOK_LPAREN)) error("Expected '(' for ASC");
-        Value v = expression();
-        if (v.type != VAL_STR) error("ASC expects string");
-        val.type = VAL_NUM;
-        val.num = (double)(unsigned char)v.str[0];
-        free(v.str);
-        if (!match(TOK_RPAREN)) error("Missing ')' for ASC");
-    } else if (current_token == TOK_CHR) {
-        next_token();
-        if (!match(TOK_LPAREN)) error("Expected '(' for CHR$");
-        Value v = expression();
-        if (v.type != VAL_NUM) error("CHR$ expects number");
-        val.type = VAL_STR;
-        val.str = malloc(2);
-        val.str[0] = (char)v.num;
-        val.str[1] = '\0';
-        if (!match(TOK_RPAREN)) error("Missing ')' for CHR$");
-    } else if (current_token == TOK_VAL) {
-        next_token();
-        if (!match(TOK_LPAREN)) error("Expected '(' for VAL");
-        Value v = expression();
-        if (v.type != VAL_STR) error("VAL expects string");
-        val.type = VAL_NUM;
-        val.num = atof(v.str);
-        free(v.str);
-        if (!match(TOK_RPAREN)) error("Missing ')' for VAL");
-    } else if (current_token == TOK_STR) {
-        next_token();
-        if (!match(TOK_LPAREN)) error("Expected '(' for STR$");
-        Value v = expression();
-        if (v.type != VAL_NUM) error("STR$ expects number");
-        val.type = VAL_STR;
-        val.str = malloc(64);
-        if (v.num == (int)v.num) sprintf(val.str, "%d", (int)v.num);
-        else sprintf(val.str, "%g", v.num);
-        if (!match(TOK_RPAREN)) error("Missing ')' for STR$");
-    } else if (current_token == TOK_MID) {
-        next_token();
-        if (!match(TOK_LPAREN)) error("Expected '(' for MID$");
-        Value v = expression();
-        if (v.type != VAL_STR) error("MID$ expects string");
-        if (!match(TOK_COMMA)) error("Expected ',' for MID$");
-        Value vstart = expression();
-        if (vstart.type != VAL_NUM) error("MID$ start expects number");
-        int start = (int)vstart.num;
-        int len = -1;
-        if (current_token == TOK_COMMA) {
-             next_token();
-             Value vlen = expression();
-             if (vlen.type != VAL_NUM) error("MID$ length expects number");
-             len = (int)vlen.num;
-        }
-        if (!match(TOK_RPAREN)) error("Missing ')' for MID$");
-        
-        val.type = VAL_STR;
-        int slen = strlen(v.str);
-        if (start < 1) start = 1; /* BASIC is 1-based usually */
-        start--; /* 0-based for C */
-        if (start >= slen) {
-             val.str = malloc(1);
-             val.str[0] = '\0';
-        } else {
-             if (len == -1 || start + len > slen) len = slen - start;
-             if (len < 0) len = 0;
-             val.str = malloc(len + 1);
-             strncpy(val.str, v.str + start, len);
-             val.str[len] = '\0';
-        }
-        free(v.str);
-    } else if (current_token == TOK_LEFT) {
-        next_token();
-        if (!match(TOK_LPAREN)) error("Expected '(' for LEFT$");
-        Value v = expression();
-        if (v.type != VAL_STR) error("LEFT$ expects string");
-        if (!match(TOK_COMMA)) error("Expected ',' for LEFT$");
-        Value vlen = expression();
-        if (vlen.type != VAL_NUM) error("LEFT$ length expects number");
-        int len = (int)vlen.num;
-        if (!match(TOK_RPAREN)) error("Missing ')' for LEFT$");
-        
-        val.type = VAL_STR;
-        int slen = strlen(v.str);
-        if (len > slen) len = slen;
-        if (len < 0) len = 0;
-        val.str = malloc(len+1);
-        strncpy(val.str, v.str, len);
-        val.str[len] = '\0';
-        free(v.str);
-    } else if (current_token == TOK_RIGHT) {
+        val = apply_builtin(TOK_INKEY, &val, 0);
+    } else if (current_token >= TOK_LEN && current_token <= TOK_STR) {
+        /* LEN, ASC, CHR$, MID$, LEFT$, RIGHT$, VAL, STR$ */
+        BasTokenType func = current_token;
+        Value args[3];
+        int nargs;
         next_token();
-        if (!match(TOK_LPAREN)) error("Expected '(' for RIGHT$");
-        Value v = expression();
-        if (v.type != VAL_STR) error("RIGHT$ expects string");
-        if (!match(TOK_COMMA)) error("Expected ',' for RIGHT$");
-        Value vlen = expression();
-        if (vlen.type != VAL_NUM) error("RIGHT$ length expects number");
-        int len = (int)vlen.num;
-        if (!match(TOK_RPAREN)) error("Missing ')' for RIGHT$");
-        
-        val.type = VAL_STR;
-        int slen = strlen(v.str);
-        if (len > slen) len = slen;
-        if (len < 0) len = 0;
-        val.str = malloc(len+1);
-        strncpy(val.str, v.str + slen - len, len);
-        val.str[len] = '\0';
-        free(v.str);
+        nargs = string_fn_args(func, args);
+        val = apply_builtin(func, args, nargs);
+        if (!match(TOK_RPAREN)) error(string_fn_message(func, SFN_RPAREN));
     } else if (current_token >= TOK_SIN && current_token <= TOK_RND) {
         BasTokenType func = current_token;
         next_token();
         if (!match(TOK_LPAREN)) error("Expected '(' for function");
         val = expression();
         if (!match(TOK_RPAREN)) error("Missing ')' for function");
-        
-        if (val.type != VAL_NUM) error("Function expects number");
-        
-        switch (func) {
-            case TOK_SIN: val.num = sin(val.num); break;
-            case TOK_COS: val.num = cos(val.num); break;
-            case TOK_TAN: val.num = tan(val.num); break;
-            case TOK_ATN: val.num = atan(val.num); break;
-            case TOK_EXP: val.num = exp(val.num); break;
-            case TOK_LOG: 
-                if (val.num <= 0) error("Log of non-positive number");
-                val.num = log(val.num); 
-                break;
-            case TOK_SQR:
-                if (val.num < 0) error("Sqrt of negative number");
-                val.num = sqrt(val.num);
-                break;
-            case TOK_INT: val.num = floor(val.num); break;
-            case TOK_ABS: val.num = fabs(val.num); break;
-            case TOK_SGN: val.num = (val.num > 0) ? 1 : ((val.num < 0) ? -1 : 0); break;
-            case TOK_RND: val.num = ((double)rand() / ((double)RAND_MAX + 1.0)); break;
-            default: break;
-        }
+        val = apply_builtin(func, &val, 1);
     } else {
         error("Expected number, variable, or function");
     }
@@ -4,9 +4,12 @@
 #include <fcntl.h>
 #include <dirent.h> // For directory listing
 #include <unistd.h> // For chdir
+#include <sys/stat.h>
+#include <sys/mman.h>
 struct termios orig_termios;
 #else
 #include <conio.h>
+#include <io.h>
 #endif
 
 int term_setup = 0; // Global definition, only one needed.
@@ -38,6 +41,7 @@ void restore_terminal(void) {
 
 // New function to read a key, handling special sequences
 int read_key(void) {
+    out_flush(); /* Show the output the key answers */
 #ifdef _WIN32
     if (_kbhit()) {
         int c = _getch();
@@ -97,16 +101,46 @@ int read_key(void) {
 #endif
 }
 
+/* program[] is kept sorted by line number, so binary search it */
 int find_line_index(int line_num) {
-    int i;
-    for (i = 0; i < program_line_count; i++) {
-        if (program[i].number == line_num) return i;
+    int lo = 0, hi = program_line_count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (program[mid].number == line_num) return mid;
+        if (program[mid].number < line_num) lo = mid + 1;
+        else hi = mid - 1;
     }
     return -1;
 }
 
+/* Parse the target of GOTO, GOSUB, THEN, ON and RESTORE and return its line
+   index. A literal line number is looked up once and the index cached in
+   its token until lines are next added or removed. */
+static int jump_target(void) {
+    Value v;
+    int idx;
+
+    if (current_token == TOK_NUMBER &&
+        (token_ptr->type == TOK_EOL || token_ptr->type == TOK_COLON || token_ptr->type == TOK_COMMA)) {
+        Token *tok = token_cur;
+        if (tok->target_gen != program_generation) {
+            idx = find_line_index((int)tok->num);
+            if (idx == -1) error("Line not found");
+            tok->slot = idx;
+            tok->target_gen = program_generation;
+        }
+        next_token();
+        return tok->slot;
+    }
+
+    v = expression();
+    if (VAL_TYPE(v) == VAL_STR) error("Line number must be numeric");
+    idx = find_line_index((int)NUM_OF(v));
+    if (idx == -1) error("Line not found");
+    return idx;
+}
+
 void cmd_run(void) {
-    int i;
     next_token();
     
     /* Reset state */
@@ -114,26 +148,15 @@ void cmd_run(void) {
     execution_finished = 0;
     for_sp = 0;
     gosub_sp = 0;
+    close_files();
     /* Clear variables? Standard BASIC does. */
-    for (i = 0; i < var_count; i++) {
-        if (variables[i].val.type == VAL_STR && variables[i].val.str) {
-            free(variables[i].val.str);
-        }
-    }
-    var_count = 0;
+    clear_variables();
     
     /* Clear arrays */
-    for (i = 0; i < array_count; i++) {
-        int j;
-        for (j = 0; j < arrays[i].total_size; j++) {
-             if (arrays[i].type == VAL_STR && arrays[i].data[j].str) {
-                 free(arrays[i].data[j].str);
-             }
-        }
-        free(arrays[i].data);
-    }
-    array_count = 0;
+    clear_arrays();
 
+    /* and DEF FN definitions, which the program makes again as it runs */
+    memset(user_functions, 0, sizeof(user_functions));
     
     run_program();
     execution_finished = 0; /* Reset for interactive */
@@ -142,6 +165,7 @@ void cmd_run(void) {
 void cmd_list(void) {
     int i;
     next_token();
+    out_flush();
     for (i = 0; i < program_line_count; i++) {
         printf("%d %s\n", program[i].number, program[i].text);
     }
@@ -151,27 +175,14 @@ void clear_program_data(void) {
     int i;
     for (i = 0; i < program_line_count; i++) {
         free(program[i].text);
+        free_tokens(program[i].tokens);
     }
     program_line_count = 0;
     /* Clear variables */
-    for (i = 0; i < var_count; i++) {
-        if (variables[i].val.type == VAL_STR && variables[i].val.str) {
-            free(variables[i].val.str);
-        }
-    }
-    var_count = 0;
+    clear_variables();
     
     /* Clear arrays */
-    for (i = 0; i < array_count; i++) {
-        int j;
-        for (j = 0; j < arrays[i].total_size; j++) {
-             if (arrays[i].type == VAL_STR && arrays[i].data[j].str) {
-                 free(arrays[i].data[j].str);
-             }
-        }
-        free(arrays[i].data);
-    }
-    array_count = 0;
+    clear_arrays();
 }
 
 void cmd_new(void) {
@@ -180,25 +191,28 @@ void cmd_new(void) {
 }
 
 // Helper to ensure .bas extension
-// Returns 1 if extension appended, 0 otherwise
-// Caller must ensure buffer is large enough
-void ensure_extension(char *filename) {
-    if (strchr(filename, '.') == NULL) {
-        strcat(filename, ".bas");
+// Returns a malloc'd copy of filename, with ".bas" appended if it has no extension
+char *with_extension(const char *filename) {
+    char *path = malloc(strlen(filename) + 5);
+    if (!path) error("Out of memory");
+    strcpy(path, filename);
+    if (strchr(path, '.') == NULL) {
+        strcat(path, ".bas");
     }
+    return path;
 }
 
 void cmd_save(void) {
-    char filename[MAX_LINE_LEN];
+    char *filename;
     FILE *fp;
     int i;
     
     next_token();
     if (current_token != TOK_STRING) error("Expected filename string");
-    strcpy(filename, token_string);
-    ensure_extension(filename);
+    filename = with_extension(token_string);
     
     fp = fopen(filename, "w");
+    free(filename);
     if (!fp) error("Could not open file for writing");
     
     for (i = 0; i < program_line_count; i++) {
@@ -210,19 +224,285 @@ void cmd_save(void) {
 }
 
 void cmd_load(void) {
-    char filename[MAX_LINE_LEN];
+    char *filename;
     
     next_token();
     if (current_token != TOK_STRING) error("Expected filename string");
-    strcpy(filename, token_string);
-    ensure_extension(filename);
+    filename = with_extension(token_string);
     
     clear_program_data();
     load_program(filename);
+    free(filename);
     
     next_token();
 }
 
+/*
+ * Sequential files: OPEN, CLOSE, PRINT #, INPUT #, LINE INPUT #, EOF()
+ * and LOF(). Each file has a buffer of FILE_BUF_SIZE bytes (more if a
+ * line needs it) and the FILE itself is unbuffered, so data moves between
+ * the disk and buf in large reads and writes. INPUT # and LINE INPUT #
+ * work on whole lines in buf. A file opened FOR INPUT ... MAPPED is
+ * instead mapped into memory whole, where it is parsed in place with no
+ * reads at all.
+ */
+
+static FileChannel files[MAX_FILES + 1];
+
+/* The open file with number n */
+static FileChannel *file_channel(int n) {
+    if (n < 1 || n > MAX_FILES || !files[n].fp) error("Bad file number");
+    return &files[n];
+}
+
+/* "[#]n" */
+static int parse_file_number(void) {
+    Value v;
+    match(TOK_HASH);
+    v = expression();
+    if (VAL_TYPE(v) == VAL_STR) error("File number must be number");
+    return index_value(v);
+}
+
+static double file_size(FILE *fp) {
+#ifdef _WIN32
+    return (double)_filelengthi64(_fileno(fp));
+#else
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) return 0;
+    return (double)st.st_size;
+#endif
+}
+
+/* Write out what an output file has waiting; returns 0 if that fails */
+static int file_flush(FileChannel *f) {
+    size_t len = f->len;
+    f->len = 0;
+    return len == 0 || fwrite(f->buf, 1, len, f->fp) == len;
+}
+
+static void file_write(FileChannel *f, const char *text, size_t len) {
+    f->size += len;
+    if (len > f->cap - f->len) {
+        if (!file_flush(f)) error("Could not write file");
+        if (len >= f->cap) {
+            if (fwrite(text, 1, len, f->fp) != len) error("Could not write file");
+            return;
+        }
+    }
+    memcpy(f->buf + f->len, text, len);
+    f->len += len;
+}
+
+/* Read more of an input file into its buffer, after the unread part;
+   returns 0 at the end of the file */
+static int file_fill(FileChannel *f) {
+    size_t got;
+    if (f->at_end) return 0;
+    if (f->pos > 0) {
+        memmove(f->buf, f->buf + f->pos, f->len - f->pos);
+        f->len -= f->pos;
+        f->pos = 0;
+    }
+    if (f->len == f->cap) {
+        /* A line longer than the buffer */
+        char *grown = realloc(f->buf, f->cap * 2);
+        if (!grown) error("Out of memory");
+        f->buf = grown;
+        f->cap *= 2;
+    }
+    got = fread(f->buf + f->len, 1, f->cap - f->len, f->fp);
+    if (got == 0) {
+        f->at_end = 1;
+        return 0;
+    }
+    f->len += got;
+    return 1;
+}
+
+/* The end of the line at the read position: its '\n', or the end of the
+   data for a last line without one. The whole line is in the buffer. */
+static char *file_line_end(FileChannel *f) {
+    size_t scanned = 0;
+    for (;;) {
+        char *nl = memchr(f->buf + f->pos + scanned, '\n', f->len - f->pos - scanned);
+        if (nl) return nl;
+        scanned = f->len - f->pos;
+        if (!file_fill(f)) return f->buf + f->len;
+    }
+}
+
+/* Move the read position past p, which is in the line being read: a ',',
+   its '\n' or the end of the data */
+static void file_skip_to(FileChannel *f, char *p) {
+    if (p < f->buf + f->len) p++;
+    f->pos = p - f->buf;
+}
+
+/* The next field for INPUT #: a quoted string, or the text up to a comma
+   or the end of the line without surrounding blanks. A numeric field also
+   ends at a blank, so "1 2" and PRINT #'s "1<TAB>2" are two fields. Blank
+   lines are skipped. The text stays in the buffer until the next read. */
+static const char *file_field(FileChannel *f, int numeric, size_t *len) {
+    const char *start;
+    char *p, *end, *q;
+
+    for (;;) {
+        char c;
+        if (f->pos == f->len && !file_fill(f)) error("Input past end");
+        c = f->buf[f->pos];
+        if (c != ' ' && c != '\t' && c != '\r' && c != '\n') break;
+        f->pos++;
+    }
+    end = file_line_end(f);
+    p = f->buf + f->pos;
+    if (*p == '"') {
+        start = p + 1;
+        q = memchr(start, '"', end - start);
+        if (!q) q = end;
+        *len = q - start;
+        p = q;
+    } else if (numeric) {
+        start = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t' && *p != '\r') p++;
+        *len = p - start;
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        if (p < end && *p != ',') {
+            /* Another field follows on the same line */
+            f->pos = p - f->buf;
+            return start;
+        }
+    } else {
+        start = p;
+        while (p < end && *p != ',') p++;
+        q = p;
+        while (q > start && (q[-1] == ' ' || q[-1] == '\t' || q[-1] == '\r')) q--;
+        *len = q - start;
+    }
+    while (p < end && *p != ',') p++;
+    file_skip_to(f, p);
+    return start;
+}
+
+/* Map all of an input file into memory as its buffer, which then holds
+   everything there is to read; returns 0 if the file cannot be mapped
+   (it is empty, say, or this is Windows) */
+static int file_map(FileChannel *f) {
+#ifndef _WIN32
+    void *map;
+    if (f->size <= 0 || f->size > (double)SIZE_MAX) return 0;
+    map = mmap(NULL, (size_t)f->size, PROT_READ, MAP_PRIVATE, fileno(f->fp), 0);
+    if (map == MAP_FAILED) return 0;
+    posix_madvise(map, (size_t)f->size, POSIX_MADV_SEQUENTIAL);
+    f->buf = map;
+    f->cap = f->len = (size_t)f->size;
+    f->at_end = 1;
+    return 1;
+#else
+    (void)f;
+    return 0;
+#endif
+}
+
+/* Give a file back; returns 0 if its last data could not be written */
+static int close_file(FileChannel *f) {
+    FILE *fp = f->fp;
+    int ok = !f->output || file_flush(f);
+    f->fp = NULL;
+#ifndef _WIN32
+    if (f->mapped) munmap(f->buf, f->cap);
+    else free(f->buf);
+#else
+    free(f->buf);
+#endif
+    f->buf = NULL;
+    return (fclose(fp) == 0) && ok;
+}
+
+void close_files(void) {
+    int n;
+    for (n = 1; n <= MAX_FILES; n++) {
+        if (files[n].fp) close_file(&files[n]);
+    }
+}
+
+/* OPEN file$ FOR INPUT|OUTPUT|APPEND AS [#]n [MAPPED] */
+void cmd_open(void) {
+    static const char *modes[] = { "rb", "wb", "ab" };
+    FileChannel *f;
+    Value name;
+    char *path;
+    int mode = 0, n, mapped;
+
+    next_token();
+    name = expression();
+    if (VAL_TYPE(name) != VAL_STR) error("Expected filename string");
+    path = temp_alloc(str_len(&name) + 1);
+    memcpy(path, str_data(&name), str_len(&name));
+    path[str_len(&name)] = '\0';
+
+    if (!match(TOK_FOR)) error("Expected FOR");
+    if (match(TOK_OUTPUT)) mode = 1;
+    else if (match(TOK_APPEND)) mode = 2;
+    else if (match(TOK_INPUT)) mode = 0;
+    else error("Expected INPUT, OUTPUT or APPEND");
+    if (!match(TOK_AS)) error("Expected AS");
+    n = parse_file_number();
+    if (n < 1 || n > MAX_FILES) error("Bad file number");
+    f = &files[n];
+    if (f->fp) error("File already open");
+    mapped = match(TOK_MAPPED);
+    if (mapped && mode != 0) error("Bad file mode");
+
+    f->fp = fopen(path, modes[mode]);
+    if (!f->fp) error("Could not open file");
+    f->output = (mode != 0);
+    f->pos = 0;
+    f->column = 0;
+    f->size = (mode == 1) ? 0 : file_size(f->fp);
+    f->mapped = mapped && file_map(f);
+    if (f->mapped) return;
+
+    f->buf = malloc(FILE_BUF_SIZE);
+    if (!f->buf) {
+        fclose(f->fp);
+        f->fp = NULL;
+        error("Out of memory");
+    }
+    setvbuf(f->fp, NULL, _IONBF, 0); /* buf does the buffering */
+    f->cap = FILE_BUF_SIZE;
+    f->len = 0;
+    f->at_end = 0;
+}
+
+/* CLOSE [[#]n, ...]; with no numbers, every open file */
+void cmd_close(void) {
+    next_token();
+    if (current_token == TOK_EOL || current_token == TOK_EOF || current_token == TOK_COLON) {
+        int n, ok = 1;
+        for (n = 1; n <= MAX_FILES; n++) {
+            if (files[n].fp && !close_file(&files[n])) ok = 0;
+        }
+        if (!ok) error("Could not write file");
+        return;
+    }
+    do {
+        if (!close_file(file_channel(parse_file_number()))) error("Could not write file");
+    } while (match(TOK_COMMA));
+}
+
+/* EOF(n): true once everything in an input file has been read */
+double file_eof(int n) {
+    FileChannel *f = file_channel(n);
+    if (f->output) error("Bad file mode");
+    return (f->pos == f->len && !file_fill(f)) ? -1.0 : 0.0;
+}
+
+/* LOF(n): the length of the file in bytes */
+double file_lof(int n) {
+    return file_channel(n)->size;
+}
+
 void cmd_edit(void) {
     char filename[] = ".temp.bas";
     char command[512];
@@ -269,25 +549,28 @@ void cmd_cls(void) {
 #ifdef _WIN32
     system("cls");
 #else
-    printf("\033[2J\033[H");
-    fflush(stdout);
+    out_write("\033[2J\033[H", 7);
+    out_flush();
 #endif
     current_column = 0;
 }
 
 void cmd_files(void) {
     next_token();
-    char path[MAX_LINE_LEN];
+    const char *path = ".";  // Default to current directory
     if (current_token == TOK_STRING) {
-        strcpy(path, token_string);
+        path = token_string; // Lives in the crunched line, so next_token() keeps it
         next_token();
-    } else {
-        strcpy(path, "."); // Default to current directory
     }
+    out_flush();
 
 #ifdef _WIN32
     WIN32_FIND_DATA findFileData;
-    HANDLE hFind = FindFirstFile(strcat(path, "\\*"), &findFileData);
+    char *pattern = malloc(strlen(path) + 3);
+    if (!pattern) error("Out of memory");
+    strcat(strcpy(pattern, path), "\\*");
+    HANDLE hFind = FindFirstFile(pattern, &findFileData);
+    free(pattern);
     if (hFind == INVALID_HANDLE_VALUE) {
         fprintf(stderr, "Error: Could not open directory %s\n", path);
         return;
@@ -316,8 +599,7 @@ void cmd_chdir(void) {
     if (current_token != TOK_STRING) {
         error("Expected directory path string for CHDIR");
     }
-    char path[MAX_LINE_LEN];
-    strcpy(path, token_string);
+    const char *path = token_string;
     next_token();
 
 #ifdef _WIN32
@@ -332,13 +614,81 @@ void cmd_chdir(void) {
 }
 
 
+/* Where PRINT writes: the screen, or the file of a PRINT # */
+static FileChannel *print_file = NULL;
+
+static void print_text(const char *text, size_t len) {
+    if (print_file) file_write(print_file, text, len);
+    else out_write(text, len);
+}
+
+static void print_spaces(int n) {
+    static const char spaces[] = "                ";
+    if (!print_file) {
+        out_spaces(n);
+        return;
+    }
+    for (; n > 16; n -= 16) file_write(print_file, spaces, 16);
+    if (n > 0) file_write(print_file, spaces, n);
+}
+
+static void print_newline(void) {
+    if (print_file) file_write(print_file, "\n", 1);
+    else out_newline();
+}
+
+/* PRINT USING format; items */
+static void print_using(int *column) {
+    Token *site = token_cur;
+    struct UsingPlan *plan;
+    int newline = 1;
+    Value format;
+
+    next_token();
+    format = expression();
+    if (VAL_TYPE(format) != VAL_STR) error("Type mismatch: Expected string");
+    if (!match(TOK_SEMICOLON)) error("Expected ; after PRINT USING format");
+    plan = site->plan = using_plan(site->plan, str_data(&format), str_len(&format));
+
+    while (current_token != TOK_EOL && current_token != TOK_EOF && current_token != TOK_COLON) {
+        *column += using_field(plan, expression(), print_text);
+        newline = 1;
+        if (current_token == TOK_SEMICOLON || current_token == TOK_COMMA) {
+            newline = 0;
+            next_token();
+        } else if (current_token != TOK_EOL && current_token != TOK_EOF && current_token != TOK_COLON) {
+            error("Expected ; or , in PRINT USING");
+        }
+    }
+    *column += using_text(plan, print_text);
+    if (newline) {
+        print_newline();
+        *column = 0;
+    }
+}
+
 void cmd_print(void) {
     int newline = 1;
+    int *column = &current_column;
     next_token();
+    print_file = NULL;
+    if (current_token == TOK_HASH) {
+        /* PRINT #n, items */
+        print_file = file_channel(parse_file_number());
+        if (!print_file->output) error("Bad file mode");
+        column = &print_file->column;
+        if (!match(TOK_COMMA) && current_token != TOK_EOL && current_token != TOK_EOF && current_token != TOK_COLON) {
+            error("Expected ,");
+        }
+    }
+    if (current_token == TOK_USING) {
+        print_using(column);
+        return;
+    }
     
     if (current_token == TOK_EOL || current_token == TOK_EOF || current_token == TOK_COLON) {
-        printf("\n");
-        current_column = 0;
+        print_newline();
+        *column = 0;
         return;
     }
 
@@ -350,43 +700,42 @@ void cmd_print(void) {
             if (!match(TOK_LPAREN)) error("Expected '(' for TAB");
             {
                 Value v = expression();
-                if (v.type != VAL_NUM) error("TAB expects number");
-                pos = v.num;
+                if (VAL_TYPE(v) == VAL_STR) error("TAB expects number");
+                pos = NUM_OF(v);
             }
             if (!match(TOK_RPAREN)) error("Expected ')' for TAB");
             
             target = (int)pos;
-            if (target > current_column) {
-                while (current_column < target) {
-                    printf(" ");
-                    current_column++;
-                }
+            if (target > *column) {
+                print_spaces(target - *column);
+                *column = target;
             }
         } else if (current_token == TOK_SPC) {
             double count;
-            int i;
             next_token();
             if (!match(TOK_LPAREN)) error("Expected '(' for SPC");
             {
                 Value v = expression();
-                if (v.type != VAL_NUM) error("SPC expects number");
-                count = v.num;
+                if (VAL_TYPE(v) == VAL_STR) error("SPC expects number");
+                count = NUM_OF(v);
             }
             if (!match(TOK_RPAREN)) error("Expected ')' for SPC");
             
-            for (i = 0; i < (int)count; i++) {
-                printf(" ");
-                current_column++;
+            if ((int)count > 0) {
+                print_spaces((int)count);
+                *column += (int)count;
             }
         } else {
             Value val = expression();
-            if (val.type == VAL_STR) {
-                printf("%s", val.str);
-                current_column += strlen(val.str);
-                free(val.str);
+            if (VAL_TYPE(val) == VAL_STR) {
+                print_text(str_data(&val), str_len(&val));
+                *column += str_len(&val);
             } else {
-                if (val.num == (int)val.num) current_column += printf("%d", (int)val.num);
-                else current_column += printf("%g", val.num);
+                char buf[32];
+                int len = format_value(val, buf);
+                if (print_file) buf[len++] = ' '; /* So INPUT # can tell numbers apart */
+                print_text(buf, len);
+                *column += len;
             }
         }
 
@@ -396,29 +745,23 @@ void cmd_print(void) {
             next_token();
         } else if (current_token == TOK_COMMA) {
             newline = 0;
-            printf("\t");
-            current_column = (current_column / 8 + 1) * 8;
+            print_text("\t", 1);
+            *column = (*column / 8 + 1) * 8;
             next_token();
         } else if (current_token != TOK_EOL && current_token != TOK_EOF && current_token != TOK_COLON) {
              /* implicit separator */
         }
     }
     if (newline) {
-        printf("\n");
-        current_column = 0;
+        print_newline();
+        *column = 0;
     }
 }
 
 void cmd_goto(void) {
-    Value v;
-    int idx;
     if (current_token == TOK_GOTO) next_token();
     
-    v = expression();
-    if (v.type != VAL_NUM) error("Line number must be numeric");
-    idx = find_line_index((int)v.num);
-    if (idx == -1) error("Line not found");
-    current_line_idx = idx - 1;
+    current_line_idx = jump_target() - 1;
 }
 
 void cmd_if(void) {
@@ -426,10 +769,10 @@ void cmd_if(void) {
     next_token();
     cond = expression();
     
-    if (cond.type != VAL_NUM) error("IF condition must be numeric");
+    if (VAL_TYPE(cond) == VAL_STR) error("IF condition must be numeric");
 
     if (match(TOK_THEN)) {
-        if (cond.num != 0.0) {
+        if (NUM_OF(cond) != 0.0) {
             if (current_token == TOK_NUMBER) {
                 cmd_goto();
             } else {
@@ -439,13 +782,8 @@ void cmd_if(void) {
             while (current_token != TOK_EOL && current_token != TOK_EOF) next_token();
         }
     } else if (match(TOK_GOTO)) {
-         if (cond.num != 0.0) {
-            Value v = expression();
-            int idx;
-            if (v.type != VAL_NUM) error("Line number must be numeric");
-            idx = find_line_index((int)v.num);
-            if (idx == -1) error("Line not found");
-            current_line_idx = idx - 1;
+         if (NUM_OF(cond) != 0.0) {
+            current_line_idx = jump_target() - 1;
          } else {
              while (current_token != TOK_EOL && current_token != TOK_EOF) next_token();
          }
@@ -454,85 +792,237 @@ void cmd_if(void) {
     }
 }
 
+/* Assign val to an array element, taking ownership of its string */
+static void store_element(Token *name, int dims, int *indices, Value val) {
+    int slot = resolve_array(name);
+    if (arrays[slot].type == VAL_STR) {
+        if (VAL_TYPE(val) != VAL_STR) error("Type mismatch, expected string");
+        array_str_set(slot, dims, indices, str_detach(val));
+    } else if (arrays[slot].type == VAL_INT) {
+        int64_t *cell = array_int_ptr(slot, dims, indices);
+        if (VAL_TYPE(val) == VAL_STR) error("Type mismatch, expected number");
+        *cell = int_value(val);
+    } else if (arrays[slot].type == VAL_SNG) {
+        float *cell = array_sng_ptr(slot, dims, indices);
+        if (VAL_TYPE(val) == VAL_STR) error("Type mismatch, expected number");
+        *cell = (float)NUM_OF(val);
+    } else {
+        double *cell = array_num_ptr(slot, dims, indices);
+        if (VAL_TYPE(val) == VAL_STR) error("Type mismatch, expected number");
+        *cell = NUM_OF(val);
+    }
+}
+
+/* Subscripts of an array assignment, READ target or DIM. Statements never
+   nest, so one buffer serves them all; it only leaves static storage for
+   arrays of more than INLINE_DIMS dimensions. */
+static int subscripts_init[INLINE_DIMS];
+static int *subscripts = subscripts_init;
+static int subscripts_cap = INLINE_DIMS;
+
+/* Parse "i, j, ...)" after an array name and its '(' into subscripts[] */
+static int parse_subscripts(const char *type_message) {
+    int dims = 0;
+    do {
+        Value v = expression();
+        if (VAL_TYPE(v) == VAL_STR) error(type_message);
+        if (dims == subscripts_cap) {
+            subscripts = grow_storage(subscripts, &subscripts_cap, INLINE_DIMS, sizeof(int));
+        }
+        subscripts[dims++] = index_value(v);
+    } while (match(TOK_COMMA));
+    if (!match(TOK_RPAREN)) error("Expected ')'");
+    return dims;
+}
+
+/* Evaluate the expression after "var =" and assign it. Since string
+   concatenation is associative, A$ = A$ + X$ + ... can evaluate the part
+   after "A$ +" first and append it to A$, which makes building up a string
+   in a loop linear rather than quadratic. */
+static void assign_var(Token *var_tok) {
+    int slot = resolve_var(var_tok);
+
+    if (variables[slot].type == VAL_STR && current_token == TOK_IDENTIFIER &&
+        token_cur->str == var_tok->str && token_ptr->type == TOK_PLUS) {
+        next_token(); /* A$ */
+        next_token(); /* + */
+        append_var(slot, expression());
+    } else {
+        set_var(slot, expression());
+    }
+}
+
 void cmd_let(void) {
-    char var_name[MAX_VAR_NAME];
+    Token *var_tok;
     
     next_token();
     if (current_token != TOK_IDENTIFIER) error("Expected variable");
-    strcpy(var_name, token_string);
+    var_tok = token_cur;
     next_token();
     
     if (current_token == TOK_LPAREN) {
         /* Array assignment */
-        int indices[MAX_DIMS];
-        int dims = 0;
+        int *indices;
+        int dims;
         Value val;
         
         next_token();
-        do {
-            if (dims >= MAX_DIMS) error("Too many subscripts");
-            Value vidx = expression();
-            if (vidx.type != VAL_NUM) error("Array index must be number");
-            indices[dims++] = (int)vidx.num;
-        } while (match(TOK_COMMA));
-        
-        if (!match(TOK_RPAREN)) error("Expected ')'");
+        dims = parse_subscripts("Array index must be number");
+        indices = subscripts;
         
         if (!match(TOK_EQ)) error("Expected =");
         
         val = expression();
         
-        {
-            Value *ptr = get_array_ptr(var_name, dims, indices);
-            if (ptr) {
-                 if (strchr(var_name, '$')) {
-                     if (val.type != VAL_STR) error("Type mismatch, expected string");
-                     if (ptr->str) free(ptr->str);
-                     ptr->type = VAL_STR;
-                     ptr->str = val.str;
-                 } else {
-                     if (val.type != VAL_NUM) error("Type mismatch, expected number");
-                     ptr->type = VAL_NUM;
-                     ptr->num = val.num;
-                 }
-            }
-        }
+        store_element(var_tok, dims, indices, val);
     } else {
         /* Normal assignment */
-        Value val;
         if (!match(TOK_EQ)) error("Expected =");
-        val = expression();
-        set_var(var_name, val);
+        assign_var(var_tok);
+    }
+}
+
+/* Whether the len characters at text are a number: digits with an
+   optional sign, point and exponent. An empty field counts, as 0. */
+static int is_number_text(const char *text, size_t len) {
+    const char *p = text, *end = text + len;
+    int digits = 0;
+    if (len == 0) return 1;
+    if (*p == '+' || *p == '-') p++;
+    for (; p < end && isdigit((unsigned char)*p); p++) digits++;
+    if (p < end && *p == '.') {
+        for (p++; p < end && isdigit((unsigned char)*p); p++) digits++;
+    }
+    if (digits == 0) return 0;
+    if (p < end && (*p == 'E' || *p == 'e')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        if (p == end || !isdigit((unsigned char)*p)) return 0;
+        while (p < end && isdigit((unsigned char)*p)) p++;
+    }
+    return p == end;
+}
+
+/* The len characters at text as an integer into *i, if they are only
+   digits, with an optional sign, and the value fits in 64 bits */
+static int parse_int_text(const char *text, size_t len, int64_t *i) {
+    const char *p = text, *end = text + len;
+    int neg = 0;
+    uint64_t n = 0, limit;
+    if (p < end && (*p == '+' || *p == '-')) neg = (*p++ == '-');
+    if (p == end) return 0;
+    limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    for (; p < end; p++) {
+        if (!isdigit((unsigned char)*p)) return 0;
+        if (n > (limit - (*p - '0')) / 10) return 0;
+        n = n * 10 + (*p - '0');
+    }
+    *i = neg ? (int64_t)(0 - n) : (int64_t)n;
+    return 1;
+}
+
+/* Store text read from a file into a variable, or an array element whose
+   subscripts are in subscripts[]. A number is parsed where the text lies
+   in the file's buffer; only a string is copied. An integer variable gets
+   the exact value of an integer beyond double precision. */
+static void store_input(Token *var_tok, int dims, const char *text, size_t len) {
+    Value val;
+    if (strchr(var_tok->str, '$')) {
+        val = str_make(text, len);
+    } else {
+        int64_t i;
+        if (!is_number_text(text, len)) error("Type mismatch: Expected number");
+        if (strchr(var_tok->str, '%') && parse_int_text(text, len, &i)) SET_INT(val, i);
+        else SET_NUM(val, parse_number(text, len));
     }
+    if (dims > 0) store_element(var_tok, dims, subscripts, val);
+    else set_var(resolve_var(var_tok), val);
+}
+
+/* Parse the variable an INPUT # or LINE INPUT # reads into, leaving any
+   subscripts in subscripts[]; returns their count */
+static int parse_input_target(Token **var_tok) {
+    if (current_token != TOK_IDENTIFIER) error("Expected variable");
+    *var_tok = token_cur;
+    next_token();
+    if (!match(TOK_LPAREN)) return 0;
+    return parse_subscripts("Array index must be number");
+}
+
+/* INPUT #n, var, ... after the INPUT */
+static void input_file(void) {
+    FileChannel *f = file_channel(parse_file_number());
+    if (f->output) error("Bad file mode");
+    if (!match(TOK_COMMA)) error("Expected ,");
+    do {
+        Token *var_tok;
+        int dims = parse_input_target(&var_tok);
+        const char *text;
+        size_t len;
+        text = file_field(f, !strchr(var_tok->str, '$'), &len);
+        store_input(var_tok, dims, text, len);
+    } while (match(TOK_COMMA));
+}
+
+/* LINE INPUT #n, var$ */
+void cmd_line(void) {
+    FileChannel *f;
+    Token *var_tok;
+    char *start, *end;
+    int dims;
+
+    next_token();
+    if (!match(TOK_INPUT)) error("Expected INPUT");
+    if (current_token != TOK_HASH) error("Expected #");
+    f = file_channel(parse_file_number());
+    if (f->output) error("Bad file mode");
+    if (!match(TOK_COMMA)) error("Expected ,");
+    dims = parse_input_target(&var_tok);
+    if (!strchr(var_tok->str, '$')) error("Type mismatch: Expected string");
+
+    if (f->pos == f->len && !file_fill(f)) error("Input past end");
+    end = file_line_end(f);
+    start = f->buf + f->pos;
+    file_skip_to(f, end);
+    if (end > start && end[-1] == '\r') end--;
+    store_input(var_tok, dims, start, end - start);
 }
 
 void cmd_input(void) {
-    char input_buffer[MAX_LINE_LEN];
-    char *input_ptr_save = NULL;
+    static char *input_buffer = NULL;
+    static size_t input_cap = 0;
+    static Token *input_tokens = NULL;
+    Token *input_ptr_save = NULL;
     int first_var = 1;
     
     /* Save main lexer state globals */
-    char *main_token_ptr;
+    Token *main_token_ptr;
     BasTokenType main_token;
     double main_token_number;
-    char main_token_string[MAX_LINE_LEN];
+    const char *main_token_string;
+    Token *main_token_cur;
 
     next_token();
+    if (current_token == TOK_HASH) {
+        input_file();
+        return;
+    }
     if (current_token == TOK_STRING) {
-        printf("%s", token_string);
+        out_write(token_string, strlen(token_string));
         current_column += strlen(token_string);
         next_token();
         if (match(TOK_SEMICOLON) || match(TOK_COMMA)) {
             /* ok */
         }
     } else {
-        printf("? ");
+        out_write("? ", 2);
         current_column += 2;
     }
     
     /* Read Line */
+    out_flush();
     restore_terminal();
-    if (!fgets(input_buffer, sizeof(input_buffer), stdin)) return;
+    if (!read_line(stdin, &input_buffer, &input_cap)) return;
     {
         size_t len = strlen(input_buffer);
         if (len > 0 && input_buffer[len-1] == '\n') input_buffer[len-1] = '\0';
@@ -552,22 +1042,25 @@ void cmd_input(void) {
 
     /* Loop over variables in program */
     do {
-         char var_name[MAX_VAR_NAME];
+         Token *var_tok;
          Value val = {0};
          
          if (current_token != TOK_IDENTIFIER) error("Expected variable");
-         strcpy(var_name, token_string);
+         var_tok = token_cur;
          next_token(); /* Consume variable in program */
          
          /* Save program state */
          main_token_ptr = token_ptr;
          main_token = current_token;
          main_token_number = token_number;
-         strcpy(main_token_string, token_string);
+         main_token_string = token_string;
+         main_token_cur = token_cur;
          
          /* Switch to input buffer */
          if (first_var) {
-             init_tokenizer(input_buffer);
+             free_tokens(input_tokens);
+             input_tokens = crunch_input(input_buffer);
+             init_tokenizer(input_tokens);
              first_var = 0;
          } else {
              /* Restore input buffer state from previous iteration? 
@@ -585,42 +1078,35 @@ void cmd_input(void) {
          if (current_token == TOK_EOL || current_token == TOK_EOF) {
              /* Not enough input? Treat as zero/empty? Or Error? Basic usually asks "??" */
              /* For simplicity, default zero/empty */
-             if (strchr(var_name, '$')) {
-                 val.type = VAL_STR;
-                 val.str = malloc(1); val.str[0] = 0;
+             if (strchr(var_tok->str, '$')) {
+                 val = str_make("", 0);
              } else {
-                 val.type = VAL_NUM; val.num = 0.0;
+                 SET_NUM(val, 0.0);
              }
          } else {
              /* Get value */
              if (current_token == TOK_MINUS) {
                   next_token();
                   if (current_token == TOK_NUMBER) {
-                      val.type = VAL_NUM;
-                      val.num = -token_number;
+                      SET_NUM(val, -token_number);
                       next_token();
                   } else error("Input error");
              } else if (current_token == TOK_NUMBER) {
-                 val.type = VAL_NUM;
-                 val.num = token_number;
+                 SET_NUM(val, token_number);
                  next_token();
              } else if (current_token == TOK_STRING) {
-                 val.type = VAL_STR;
-                 val.str = malloc(strlen(token_string)+1);
-                 strcpy(val.str, token_string);
+                 val = str_make(token_string, strlen(token_string));
                  next_token();
              } else {
                  /* Maybe unquoted string? Tokenizer might identify as IDENTIFIER? */
                  /* For INPUT, often unquoted strings are allowed. 
                     If tokenizer sees IDENTIFIER, treat as string? */
                  if (current_token == TOK_IDENTIFIER) {
-                     val.type = VAL_STR;
-                     val.str = malloc(strlen(token_string)+1);
-                     strcpy(val.str, token_string);
+                     val = str_make(token_string, strlen(token_string));
                      next_token();
                  } else {
                      /* Fallback for numbers not parsed correctly? */
-                      val.type = VAL_NUM; val.num = 0.0;
+                      SET_NUM(val, 0.0);
                  }
              }
          }
@@ -632,30 +1118,28 @@ void cmd_input(void) {
          token_ptr = main_token_ptr;
          current_token = main_token;
          token_number = main_token_number;
-         strcpy(token_string, main_token_string);
+         token_string = main_token_string;
+         token_cur = main_token_cur;
          
          /* Assign */
-         if (strchr(var_name, '$')) {
-             if (val.type != VAL_STR) {
+         if (strchr(var_tok->str, '$')) {
+             if (VAL_TYPE(val) != VAL_STR) {
                  /* Conversion or error? */
                  /* If we read a number into a string var? Convert it? */
-                 if (val.type == VAL_NUM) {
-                     val.type = VAL_STR;
-                     val.str = malloc(32);
-                     sprintf(val.str, "%g", val.num);
+                 if (VAL_TYPE(val) != VAL_STR) {
+                     char buf[32];
+                     val = str_make(buf, format_value(val, buf));
                  }
              }
          } else {
-             if (val.type != VAL_NUM) {
-                 if (val.type == VAL_STR) {
-                     val.type = VAL_NUM;
-                     val.num = atof(val.str);
-                     free(val.str);
+             if (VAL_TYPE(val) != VAL_NUM) {
+                 if (VAL_TYPE(val) == VAL_STR) {
+                     SET_NUM(val, str_to_num(&val));
                  }
              }
          }
          
-         set_var(var_name, val);
+         set_var(resolve_var(var_tok), val);
          
          if (match(TOK_COMMA)) {
              /* Continue loop */
@@ -674,13 +1158,14 @@ void cmd_sleep(void) {
     if (!match(TOK_LPAREN)) error("Expected (");
     {
         Value v = expression();
-        if (v.type != VAL_NUM) error("Sleep expects number");
-        ticks = v.num;
+        if (VAL_TYPE(v) == VAL_STR) error("Sleep expects number");
+        ticks = NUM_OF(v);
     }
     if (!match(TOK_RPAREN)) error("Expected ) ");
     
     /* 60 ticks = 1 second. Convert to milliseconds. */
     msec = (long)(ticks * 1000 / 60);
+    out_flush(); /* Show what came before the pause */
 
 #ifdef _WIN32
     Sleep(msec);
@@ -715,97 +1200,142 @@ void print_line_buffer(const char *prompt, const char *buffer, int cursor_pos) {
     fflush(stdout);
 }
 void cmd_for(void) {
-    char var_name[MAX_VAR_NAME];
-    double start_val, end_val, step_val = 1.0;
-    Value v;
+    int var;
+    Value start, end, step;
+    ForLoop *loop;
     
     next_token();
     if (current_token != TOK_IDENTIFIER) error("Expected variable");
-    strcpy(var_name, token_string);
+    var = resolve_var(token_cur);
     next_token();
     
     if (!match(TOK_EQ)) error("Expected =");
-    v = expression();
-    if (v.type != VAL_NUM) error("For start must be number");
-    start_val = v.num;
+    start = expression();
+    if (VAL_TYPE(start) == VAL_STR) error("For start must be number");
     
     if (!match(TOK_TO)) error("Expected TO");
-    v = expression();
-    if (v.type != VAL_NUM) error("For end must be number");
-    end_val = v.num;
+    end = expression();
+    if (VAL_TYPE(end) == VAL_STR) error("For end must be number");
     
+    SET_INT(step, 1);
     if (match(TOK_STEP)) {
-        v = expression();
-        if (v.type != VAL_NUM) error("For step must be number");
-        step_val = v.num;
+        step = expression();
+        if (VAL_TYPE(step) == VAL_STR) error("For step must be number");
     }
     
-    v.type = VAL_NUM;
-    v.num = start_val;
-    set_var(var_name, v);
-    
+    /* A FOR on a variable that is already looping (typically after jumping
+       out of the loop) restarts it, discarding it and any loops inside it,
+       so the stack cannot grow without bound. */
+    {
+        int i;
+        for (i = for_sp - 1; i >= 0; i--) {
+            if (for_stack[i].var == var) {
+                for_sp = i;
+                break;
+            }
+        }
+    }
+
     /* Push to stack */
-    if (for_sp < STACK_SIZE) {
-        strcpy(for_stack[for_sp].var, var_name);
-        for_stack[for_sp].target = end_val;
-        for_stack[for_sp].step = step_val;
-        for_stack[for_sp].line_idx = current_line_idx;
-        for_stack[for_sp].resume_ptr = token_ptr; /* Save resume internal pointer */
-        for_sp++;
+    if (for_sp == for_cap) {
+        for_stack = grow_storage(for_stack, &for_cap, INIT_STACK, sizeof(ForLoop));
+    }
+    loop = &for_stack[for_sp];
+    loop->var = var;
+    if (variables[var].type == VAL_INT) {
+        /* Counted in integers from here on */
+        loop->itarget = int_value(end);
+        loop->istep = int_value(step);
+        loop->kind = loop->istep > 0 ? FOR_INT_UP : FOR_INT_DOWN;
+    } else {
+        loop->target = NUM_OF(end);
+        loop->step = NUM_OF(step);
+        if (variables[var].type == VAL_SNG) {
+            loop->kind = loop->step > 0 ? FOR_SNG_UP : FOR_SNG_DOWN;
+        } else {
+            loop->kind = loop->step > 0 ? FOR_NUM_UP : FOR_NUM_DOWN;
+        }
+    }
+    /* Only now, as end and step may borrow the variable's value */
+    set_var(var, start);
+    /* The body starts after the ':' or, when FOR ends its line, at the top
+       of the next line, so NEXT can go straight there */
+    if (current_token == TOK_EOL && current_line_idx >= 0 &&
+        current_line_idx + 1 < program_line_count) {
+        loop->line_idx = current_line_idx + 1;
+        loop->resume_ptr = program[current_line_idx + 1].tokens;
     } else {
-        error("FOR stack overflow");
+        loop->line_idx = current_line_idx;
+        loop->resume_ptr = token_ptr;
     }
+    for_sp++;
 }
 
 void cmd_next(void) {
+    ForLoop *loop;
+    Value *v;
+    int64_t i;
+    int loop_continues;
+
     next_token();
-    if (current_token != TOK_IDENTIFIER) {
+    if (for_sp == 0) error("NEXT without FOR");
+    loop = &for_stack[for_sp-1];
+    if (current_token == TOK_IDENTIFIER) {
         /* Optional variable name */
-    } else {
-        if (for_sp > 0 && strcmp(token_string, for_stack[for_sp-1].var) != 0) {
+        if (resolve_var(token_cur) != loop->var) {
             error("NEXT without matching FOR variable");
         }
         next_token();
     }
     
-    if (for_sp > 0) {
-        ForLoop *loop = &for_stack[for_sp-1];
-        Value v = get_var(loop->var);
-        int loop_continues = 0;
-        
-        v.num += loop->step;
-        set_var(loop->var, v);
-        
-        if (loop->step > 0) loop_continues = (v.num <= loop->target);
-        else loop_continues = (v.num >= loop->target);
-        
-        if (loop_continues) {
-            current_line_idx = loop->line_idx; 
-            jump_to_ptr = loop->resume_ptr; /* Request resume within line */
-        } else {
-            for_sp--;
-        }
+    /* FOR only accepts numeric variables, so update the slot in place */
+    v = &variables[loop->var].val;
+    switch (loop->kind) {
+    case FOR_NUM_UP:
+        loop_continues = ((v->num += loop->step) <= loop->target);
+        break;
+    case FOR_NUM_DOWN:
+        loop_continues = ((v->num += loop->step) >= loop->target);
+        break;
+    case FOR_SNG_UP:
+        loop_continues = ((v->num = (float)(v->num + loop->step)) <= loop->target);
+        break;
+    case FOR_SNG_DOWN:
+        loop_continues = ((v->num = (float)(v->num + loop->step)) >= loop->target);
+        break;
+    case FOR_INT_UP:
+        i = INT_OF(*v);
+        if (i > INT64_MAX - loop->istep) error("Overflow");
+        STORE_INT(*v, i + loop->istep);
+        loop_continues = (i + loop->istep <= loop->itarget);
+        break;
+    default: /* FOR_INT_DOWN */
+        i = INT_OF(*v);
+        if (i < INT64_MIN - loop->istep) error("Overflow");
+        STORE_INT(*v, i + loop->istep);
+        loop_continues = (i + loop->istep >= loop->itarget);
+        break;
+    }
+    
+    if (loop_continues) {
+        current_line_idx = loop->line_idx; 
+        jump_to_ptr = loop->resume_ptr; /* Request resume at the body */
     } else {
-        error("NEXT without FOR");
+        for_sp--;
     }
 }
 
 void cmd_gosub(void) {
-    Value v;
     int idx;
     next_token();
-    v = expression();
-    if (v.type != VAL_NUM) error("Line number must be numeric");
-    idx = find_line_index((int)v.num);
-    if (idx == -1) error("Line not found");
+    idx = jump_target();
     
-    if (gosub_sp < STACK_SIZE) {
-        gosub_stack[gosub_sp].line_idx = current_line_idx;
-        gosub_sp++;
-        current_line_idx = idx - 1;
-    } else {
-        error("GOSUB stack overflow");
+    if (gosub_sp == gosub_cap) {
+        gosub_stack = grow_storage(gosub_stack, &gosub_cap, INIT_STACK, sizeof(GosubFrame));
     }
+    gosub_stack[gosub_sp].line_idx = current_line_idx;
+    gosub_sp++;
+    current_line_idx = idx - 1;
 }
 
 void cmd_return(void) {
@@ -824,11 +1354,8 @@ void cmd_end(void) {
 }
 
 void cmd_rem(void) {
-    /* Skip to end of line without tokenizing */
-    while (*token_ptr && *token_ptr != '\n' && *token_ptr != '\r') {
-        token_ptr++;
-    }
-    current_token = TOK_EOL;
+    /* The cruncher stops at REM, so the next token is the end of line */
+    next_token();
 }
 
 void cmd_data(void) {
@@ -840,10 +1367,7 @@ void cmd_data(void) {
 void cmd_restore(void) {
     next_token();
     if (current_token == TOK_NUMBER) {
-         int idx = find_line_index((int)token_number);
-         if (idx == -1) error("Line not found");
-         data_line_idx = idx;
-         next_token();
+         data_line_idx = jump_target();
     } else {
          data_line_idx = 0;
     }
@@ -854,40 +1378,37 @@ void cmd_read(void) {
     next_token(); /* Consume READ */
     
     do {
-         char var_name[MAX_VAR_NAME];
+         Token *var_tok;
          Value val = {0};
          /* Variables for saving main lexer state */
-         char *main_token_ptr;
+         Token *main_token_ptr;
          BasTokenType main_token;
          double main_token_number;
-         char main_token_string[MAX_LINE_LEN];
+         const char *main_token_string;
+         Token *main_token_cur;
          
          /* Main lexer: get variable name */
          if (current_token != TOK_IDENTIFIER) error("Expected variable in READ");
-         strcpy(var_name, token_string);
+         var_tok = token_cur;
          next_token();
          
          /* Check for array indices */
-         int indices[MAX_DIMS];
+         int *indices = NULL;
          int dims = 0;
          int is_array = 0;
          if (current_token == TOK_LPAREN) {
              is_array = 1;
              next_token();
-             do {
-                 if (dims >= MAX_DIMS) error("Too many subscripts");
-                 Value vidx = expression();
-                 if (vidx.type != VAL_NUM) error("Array index must be number");
-                 indices[dims++] = (int)vidx.num;
-             } while (match(TOK_COMMA));
-             if (!match(TOK_RPAREN)) error("Expected ')'");
+             dims = parse_subscripts("Array index must be number");
+             indices = subscripts;
          }
 
          /* Save Main Lexer State */
          main_token_ptr = token_ptr;
          main_token = current_token;
          main_token_number = token_number;
-         strcpy(main_token_string, token_string);
+         main_token_string = token_string;
+         main_token_cur = token_cur;
          
          /* Find value from DATA */
          {
@@ -896,10 +1417,9 @@ void cmd_read(void) {
                  if (data_ptr == NULL) {
                      /* Scan for next DATA statement */
                      while (data_line_idx < program_line_count) {
-                          char *p = program[data_line_idx].text;
                           int found_data = 0;
 
-                          init_tokenizer(p); 
+                          init_tokenizer(program[data_line_idx].tokens);
                           
                           while(current_token != TOK_EOL && current_token != TOK_EOF) {
                               if (current_token == TOK_DATA) {
@@ -945,24 +1465,18 @@ void cmd_read(void) {
                  
                  /* Parse Value */
                  if (current_token == TOK_STRING) {
-                     val.type = VAL_STR;
-                     val.str = malloc(strlen(token_string)+1);
-                     strcpy(val.str, token_string);
+                     val = str_make(token_string, strlen(token_string));
                  } else if (current_token == TOK_NUMBER) {
-                     val.type = VAL_NUM;
-                     val.num = token_number;
+                     SET_NUM(val, token_number);
                  } else if (current_token == TOK_MINUS) {
                       next_token();
                       if (current_token == TOK_NUMBER) {
-                          val.type = VAL_NUM;
-                          val.num = -token_number;
+                          SET_NUM(val, -token_number);
                       } else {
                           error("Syntax error in DATA");
                       }
                  } else if (current_token == TOK_IDENTIFIER) {
-                     val.type = VAL_STR;
-                     val.str = malloc(strlen(token_string)+1);
-                     strcpy(val.str, token_string);
+                     val = str_make(token_string, strlen(token_string));
                  } else {
                      error("Syntax error in DATA");
                  }
@@ -976,39 +1490,24 @@ void cmd_read(void) {
          token_ptr = main_token_ptr;
          current_token = main_token;
          token_number = main_token_number;
-         strcpy(token_string, main_token_string);
+         token_string = main_token_string;
+         token_cur = main_token_cur;
          
+         if (strchr(var_tok->str, '$')) {
+             if (VAL_TYPE(val) != VAL_STR) {
+                  /* Allow number to string conversion for robustness */
+                  char buf[32];
+                  val = str_make(buf, format_value(val, buf));
+             }
+         }
          if (is_array) {
-             Value *ptr = get_array_ptr(var_name, dims, indices);
-             if (ptr) {
-                 if (strchr(var_name, '$')) {
-                     if (val.type != VAL_STR) {
-                         /* Convert number to string if needed? Or error */
-                         if (val.type == VAL_NUM) {
-                              /* Allow number to string conversion for robustness? */
-                              val.type = VAL_STR;
-                              val.str = malloc(32);
-                              sprintf(val.str, "%g", val.num);
-                         }
-                     }
-                     if (ptr->str) free(ptr->str);
-                     ptr->type = VAL_STR;
-                     ptr->str = val.str;
-                 } else {
-                     if (val.type != VAL_NUM) {
-                         if (val.type == VAL_STR) {
-                             /* Try to convert string to number */
-                             val.type = VAL_NUM;
-                             val.num = atof(val.str);
-                             free(val.str);
-                         }
-                     }
-                     ptr->type = VAL_NUM;
-                     ptr->num = val.num;
-                 }
+             if (VAL_TYPE(val) == VAL_STR && !strchr(var_tok->str, '$')) {
+                 /* Try to convert string to number */
+                 SET_NUM(val, str_to_num(&val));
              }
+             store_element(var_tok, dims, indices, val);
          } else {
-             set_var(var_name, val);
+             set_var(resolve_var(var_tok), val);
          }
          
     } while (match(TOK_COMMA));
@@ -1018,35 +1517,28 @@ void cmd_dim(void) {
     next_token(); /* Consume DIM */
     
     do {
-        char var_name[MAX_VAR_NAME];
-        int sizes[MAX_DIMS];
-        int dims = 0;
+        Token *var_tok;
+        int dims, d;
         
         if (current_token != TOK_IDENTIFIER) error("Expected array name");
-        strcpy(var_name, token_string);
+        var_tok = token_cur;
         next_token();
         
         if (!match(TOK_LPAREN)) error("Expected '('");
         
-        do {
-            if (dims >= MAX_DIMS) error("Too many dimensions");
-            Value v = expression();
-            if (v.type != VAL_NUM) error("Array dimension must be number");
-            sizes[dims++] = (int)v.num + 1; /* 0-based indexing */
-        } while (match(TOK_COMMA));
-        
-        if (!match(TOK_RPAREN)) error("Expected ')'");
+        dims = parse_subscripts("Array dimension must be number");
+        for (d = 0; d < dims; d++) subscripts[d]++; /* 0-based indexing */
         
-        create_array(var_name, dims, sizes);
+        create_array(resolve_array(var_tok), dims, subscripts);
         
     } while (match(TOK_COMMA));
 }
 
 void cmd_def(void) {
     char func_name[MAX_VAR_NAME];
-    char arg_name[MAX_VAR_NAME];
+    int arg;
     int func_idx;
-    char *expr_start;
+    Token *expr_start;
     
     next_token(); /* Consume DEF */
     
@@ -1063,7 +1555,7 @@ void cmd_def(void) {
     if (!match(TOK_LPAREN)) error("Expected '('");
     
     if (current_token != TOK_IDENTIFIER) error("Expected argument name");
-    strcpy(arg_name, token_string);
+    arg = resolve_var(token_cur);
     next_token();
     
     if (!match(TOK_RPAREN)) error("Expected ')'");
@@ -1074,8 +1566,8 @@ void cmd_def(void) {
     next_token(); /* Consume '='. Now current_token is the first token of logical expression. */
     
     /* Save definition */
-    strcpy(user_functions[func_idx].arg_name, arg_name);
-    user_functions[func_idx].expr_text = expr_start;
+    user_functions[func_idx].arg = arg;
+    user_functions[func_idx].expr = expr_start;
     user_functions[func_idx].defined = 1;
     
     /* Skip to end of statement */
@@ -1087,27 +1579,25 @@ void cmd_def(void) {
 void cmd_on(void) {
     next_token(); /* Consume ON */
     Value v = expression();
-    if (v.type != VAL_NUM) error("ON expects number");
-    int choice = (int)v.num;
+    if (VAL_TYPE(v) == VAL_STR) error("ON expects number");
+    int choice = (int)NUM_OF(v);
     
     if (!match(TOK_GOTO)) error("Expected GOTO");
     
-    int target_line = -1;
+    int target_idx = -1;
     int current_choice = 1;
     
     do {
-         Value vline = expression();
          if (current_choice == choice) {
-             if (vline.type != VAL_NUM) error("Line number must be numeric");
-             target_line = (int)vline.num;
+             target_idx = jump_target();
+         } else {
+             expression();
          }
          current_choice++;
     } while (match(TOK_COMMA));
     
-    if (target_line != -1) {
-         int idx = find_line_index(target_line);
-         if (idx == -1) error("Line not found");
-         current_line_idx = idx - 1;
+    if (target_idx != -1) {
+         current_line_idx = target_idx - 1;
     }
 }
 
@@ -1141,54 +1631,33 @@ void exec_statement(void) {
     else if (current_token == TOK_READ) cmd_read();
     else if (current_token == TOK_RESTORE) cmd_restore();
     else if (current_token == TOK_DIM) cmd_dim();
+    else if (current_token == TOK_OPEN) cmd_open();
+    else if (current_token == TOK_CLOSE) cmd_close();
+    else if (current_token == TOK_LINE) cmd_line();
     else if (current_token == TOK_IDENTIFIER) {
-        char var_name[MAX_VAR_NAME];
-        strcpy(var_name, token_string);
+        Token *var_tok;
+        var_tok = token_cur;
         next_token();
         
         if (current_token == TOK_LPAREN) {
             /* Array assignment */
-            int indices[MAX_DIMS];
-            int dims = 0;
+            int *indices;
+            int dims;
             Value val;
             
             next_token();
-            do {
-                if (dims >= MAX_DIMS) error("Too many subscripts");
-                Value vidx = expression();
-                if (vidx.type != VAL_NUM) error("Array index must be number");
-                indices[dims++] = (int)vidx.num;
-            } while (match(TOK_COMMA));
-            
-            if (!match(TOK_RPAREN)) error("Expected ')'");
+            dims = parse_subscripts("Array index must be number");
+            indices = subscripts;
             
             if (!match(TOK_EQ)) error("Expected =");
             
             val = expression();
             
-            {
-                Value *ptr = get_array_ptr(var_name, dims, indices);
-                /* Type check */
-                if (ptr) {
-                     if (strchr(var_name, '$')) {
-                         if (val.type != VAL_STR) error("Type mismatch, expected string");
-                         if (ptr->str) free(ptr->str);
-                         ptr->type = VAL_STR;
-                         ptr->str = val.str; /* take ownership */
-                         /* But wait, expression return gives us a copy, so we take it. */
-                     } else {
-                         if (val.type != VAL_NUM) error("Type mismatch, expected number");
-                         ptr->type = VAL_NUM;
-                         ptr->num = val.num;
-                     }
-                }
-            }
+            store_element(var_tok, dims, indices, val);
             
         } else if (current_token == TOK_EQ) {
-            Value val;
             next_token();
-            val = expression();
-            set_var(var_name, val);
+            assign_var(var_tok);
         } else {
             error("Syntax error or unknown command");
         }
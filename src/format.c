@@ -0,0 +1,819 @@
+#include "bas.h"
+#include <time.h>
+
+/* The text of a number, as PRINT, STR$ and the INPUT and READ conversions
+   show it: an integer (%) value in full, and a double with the fewest
+   digits that read back as the same double. Following MS BASIC, there are
+   no trailing zeros and no ".0", and a number is written out in full when
+   its exponent is from -4 to 15: 1/4 is "0.25", 2^40 is "1099511627776".
+   Beyond that it takes an exponent, "1e+16" or "1.5e-07", as "%g" writes
+   one. Infinities and NaN come out as "%g" shows them.
+
+   The digits come from Grisu3 (Florian Loitsch, "Printing Floating-Point
+   Numbers Quickly and Accurately with Integers", PLDI 2010), in 64-bit
+   integer arithmetic. For about one double in two hundred Grisu3 cannot
+   prove its digits are the shortest, and shortest_libc() finds them with
+   sprintf() and strtod() instead. */
+
+/* The powers of ten that are exact as doubles */
+static const double pow10_exact[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Decimal digits of n, returning their count */
+static int format_uint(uint64_t n, char *buf) {
+    char tmp[24];
+    int len = 0, i;
+    do {
+        tmp[len++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    for (i = 0; i < len; i++) buf[i] = tmp[len - 1 - i];
+    return len;
+}
+
+/* A number f * 2^e with a 64-bit significand ("do-it-yourself floating
+   point") */
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+/* 10^k for k = -348, -340, ..., 340 as normalized DiyFps, rounded to
+   nearest: significand, binary exponent, k */
+static const struct {
+    uint64_t f;
+    short e;
+    short k;
+} cached_powers[] = {
+    {0xFA8FD5A0081C0288ULL, -1220, -348},
+    {0xBAAEE17FA23EBF76ULL, -1193, -340},
+    {0x8B16FB203055AC76ULL, -1166, -332},
+    {0xCF42894A5DCE35EAULL, -1140, -324},
+    {0x9A6BB0AA55653B2DULL, -1113, -316},
+    {0xE61ACF033D1A45DFULL, -1087, -308},
+    {0xAB70FE17C79AC6CAULL, -1060, -300},
+    {0xFF77B1FCBEBCDC4FULL, -1034, -292},
+    {0xBE5691EF416BD60CULL, -1007, -284},
+    {0x8DD01FAD907FFC3CULL, -980, -276},
+    {0xD3515C2831559A83ULL, -954, -268},
+    {0x9D71AC8FADA6C9B5ULL, -927, -260},
+    {0xEA9C227723EE8BCBULL, -901, -252},
+    {0xAECC49914078536DULL, -874, -244},
+    {0x823C12795DB6CE57ULL, -847, -236},
+    {0xC21094364DFB5637ULL, -821, -228},
+    {0x9096EA6F3848984FULL, -794, -220},
+    {0xD77485CB25823AC7ULL, -768, -212},
+    {0xA086CFCD97BF97F4ULL, -741, -204},
+    {0xEF340A98172AACE5ULL, -715, -196},
+    {0xB23867FB2A35B28EULL, -688, -188},
+    {0x84C8D4DFD2C63F3BULL, -661, -180},
+    {0xC5DD44271AD3CDBAULL, -635, -172},
+    {0x936B9FCEBB25C996ULL, -608, -164},
+    {0xDBAC6C247D62A584ULL, -582, -156},
+    {0xA3AB66580D5FDAF6ULL, -555, -148},
+    {0xF3E2F893DEC3F126ULL, -529, -140},
+    {0xB5B5ADA8AAFF80B8ULL, -502, -132},
+    {0x87625F056C7C4A8BULL, -475, -124},
+    {0xC9BCFF6034C13053ULL, -449, -116},
+    {0x964E858C91BA2655ULL, -422, -108},
+    {0xDFF9772470297EBDULL, -396, -100},
+    {0xA6DFBD9FB8E5B88FULL, -369, -92},
+    {0xF8A95FCF88747D94ULL, -343, -84},
+    {0xB94470938FA89BCFULL, -316, -76},
+    {0x8A08F0F8BF0F156BULL, -289, -68},
+    {0xCDB02555653131B6ULL, -263, -60},
+    {0x993FE2C6D07B7FACULL, -236, -52},
+    {0xE45C10C42A2B3B06ULL, -210, -44},
+    {0xAA242499697392D3ULL, -183, -36},
+    {0xFD87B5F28300CA0EULL, -157, -28},
+    {0xBCE5086492111AEBULL, -130, -20},
+    {0x8CBCCC096F5088CCULL, -103, -12},
+    {0xD1B71758E219652CULL, -77, -4},
+    {0x9C40000000000000ULL, -50, 4},
+    {0xE8D4A51000000000ULL, -24, 12},
+    {0xAD78EBC5AC620000ULL, 3, 20},
+    {0x813F3978F8940984ULL, 30, 28},
+    {0xC097CE7BC90715B3ULL, 56, 36},
+    {0x8F7E32CE7BEA5C70ULL, 83, 44},
+    {0xD5D238A4ABE98068ULL, 109, 52},
+    {0x9F4F2726179A2245ULL, 136, 60},
+    {0xED63A231D4C4FB27ULL, 162, 68},
+    {0xB0DE65388CC8ADA8ULL, 189, 76},
+    {0x83C7088E1AAB65DBULL, 216, 84},
+    {0xC45D1DF942711D9AULL, 242, 92},
+    {0x924D692CA61BE758ULL, 269, 100},
+    {0xDA01EE641A708DEAULL, 295, 108},
+    {0xA26DA3999AEF774AULL, 322, 116},
+    {0xF209787BB47D6B85ULL, 348, 124},
+    {0xB454E4A179DD1877ULL, 375, 132},
+    {0x865B86925B9BC5C2ULL, 402, 140},
+    {0xC83553C5C8965D3DULL, 428, 148},
+    {0x952AB45CFA97A0B3ULL, 455, 156},
+    {0xDE469FBD99A05FE3ULL, 481, 164},
+    {0xA59BC234DB398C25ULL, 508, 172},
+    {0xF6C69A72A3989F5CULL, 534, 180},
+    {0xB7DCBF5354E9BECEULL, 561, 188},
+    {0x88FCF317F22241E2ULL, 588, 196},
+    {0xCC20CE9BD35C78A5ULL, 614, 204},
+    {0x98165AF37B2153DFULL, 641, 212},
+    {0xE2A0B5DC971F303AULL, 667, 220},
+    {0xA8D9D1535CE3B396ULL, 694, 228},
+    {0xFB9B7CD9A4A7443CULL, 720, 236},
+    {0xBB764C4CA7A44410ULL, 747, 244},
+    {0x8BAB8EEFB6409C1AULL, 774, 252},
+    {0xD01FEF10A657842CULL, 800, 260},
+    {0x9B10A4E5E9913129ULL, 827, 268},
+    {0xE7109BFBA19C0C9DULL, 853, 276},
+    {0xAC2820D9623BF429ULL, 880, 284},
+    {0x80444B5E7AA7CF85ULL, 907, 292},
+    {0xBF21E44003ACDD2DULL, 933, 300},
+    {0x8E679C2F5E44FF8FULL, 960, 308},
+    {0xD433179D9C8CB841ULL, 986, 316},
+    {0x9E19DB92B4E31BA9ULL, 1013, 324},
+    {0xEB96BF6EBADF77D9ULL, 1039, 332},
+    {0xAF87023B9BF0EE6BULL, 1066, 340}
+};
+
+/* The upper 64 bits of the 128-bit product, rounded */
+static DiyFp diy_times(DiyFp x, DiyFp y) {
+    const uint64_t m32 = 0xFFFFFFFFu;
+    uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & m32) + (bc & m32) + (1u << 31);
+    DiyFp r;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static DiyFp diy_normalize(DiyFp x) {
+    while (!(x.f & ((uint64_t)1 << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* Moves the last digit of buf[0..len-1] down towards w while that stays
+   within the interval, and says whether the result is certainly the
+   closest shortest number: Grisu3's round_weed(). All distances are in
+   units of 2^-kappa scaled, as is rest (the distance from the digits to
+   too_high) and ten_kappa (the weight of the last digit); unit is the
+   error bound. */
+static int round_weed(char *buf, int len, uint64_t distance_too_high_w,
+                      uint64_t unsafe_interval, uint64_t rest,
+                      uint64_t ten_kappa, uint64_t unit) {
+    uint64_t small_distance = distance_too_high_w - unit;
+    uint64_t big_distance = distance_too_high_w + unit;
+
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance ||
+            small_distance - rest >= rest + ten_kappa - small_distance)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance ||
+         big_distance - rest > rest + ten_kappa - big_distance)) {
+        return 0;
+    }
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+/* The shortest digits of a w scaled so that its exponent is from -60 to
+   -32, between the scaled boundaries low and high, into buf; *kappa is
+   the power of ten of the last digit. Returns 0 if they cannot be proved
+   right. */
+static int digit_gen(DiyFp low, DiyFp w, DiyFp high, char *buf, int *len, int *kappa) {
+    static const uint32_t pow10_32[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+    uint64_t unit = 1;
+    uint64_t too_low = low.f - unit, too_high = high.f + unit;
+    uint64_t unsafe_interval = too_high - too_low;
+    int shift = -w.e;
+    uint64_t one = (uint64_t)1 << shift;
+    uint32_t integrals = (uint32_t)(too_high >> shift);
+    uint64_t fractionals = too_high & (one - 1);
+    uint32_t divisor;
+    int k = 10;
+
+    while (k > 0 && integrals < pow10_32[k - 1]) k--;
+    divisor = k > 0 ? pow10_32[k - 1] : 0;
+    *kappa = k;
+    *len = 0;
+
+    while (*kappa > 0) {
+        uint64_t rest;
+        buf[(*len)++] = (char)('0' + integrals / divisor);
+        integrals %= divisor;
+        (*kappa)--;
+        rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            return round_weed(buf, *len, too_high - w.f, unsafe_interval, rest,
+                              (uint64_t)divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        buf[(*len)++] = (char)('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        (*kappa)--;
+        if (fractionals < unsafe_interval) {
+            return round_weed(buf, *len, (too_high - w.f) * unit, unsafe_interval,
+                              fractionals, one, unit);
+        }
+    }
+}
+
+/* The shortest digits of x, which is finite and above zero, into digits
+   (at least 18 bytes), and their count; x is 0.d1d2... * 10^*point.
+   Returns 0 if Grisu3 is not sure of them. */
+static int shortest_grisu(double x, char *digits, int *point) {
+    uint64_t bits, fraction;
+    int biased, len, kappa, k, index;
+    DiyFp w, plus, minus, c;
+
+    memcpy(&bits, &x, sizeof bits);
+    fraction = bits & (((uint64_t)1 << 52) - 1);
+    biased = (int)(bits >> 52) & 0x7FF;
+    if (biased) {
+        w.f = fraction | ((uint64_t)1 << 52);
+        w.e = biased - 1075;
+    } else {
+        w.f = fraction;
+        w.e = -1074;
+    }
+
+    /* The boundaries halfway to the neighbouring doubles. The one below
+       is nearer when x is a power of two with a smaller exponent below. */
+    plus.f = (w.f << 1) + 1;
+    plus.e = w.e - 1;
+    plus = diy_normalize(plus);
+    if (fraction == 0 && biased > 1) {
+        minus.f = (w.f << 2) - 1;
+        minus.e = w.e - 2;
+    } else {
+        minus.f = (w.f << 1) - 1;
+        minus.e = w.e - 1;
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    w = diy_normalize(w);
+
+    /* A cached power of ten that brings w's exponent into -60..-32 */
+    k = (int)ceil((-60 - (w.e + 64) + 63) * 0.30102999566398114);
+    index = (348 + k - 1) / 8 + 1;
+    c.f = cached_powers[index].f;
+    c.e = cached_powers[index].e;
+
+    if (!digit_gen(diy_times(minus, c), diy_times(w, c), diy_times(plus, c),
+                   digits, &len, &kappa)) {
+        return 0;
+    }
+    *point = len + kappa - cached_powers[index].k;
+    return len;
+}
+
+/* The shortest digits of x, as shortest_grisu() gives them, by asking
+   sprintf() for ever more digits until strtod() reads back x */
+static int shortest_libc(double x, char *digits, int *point) {
+    char buf[40];
+    int precision, len = 0;
+    char *p;
+
+    for (precision = 1; precision < 17; precision++) {
+        sprintf(buf, "%.*e", precision - 1, x);
+        if (strtod(buf, NULL) == x) break;
+    }
+    if (precision == 17) sprintf(buf, "%.16e", x);
+    for (p = buf; *p != 'e'; p++) {
+        if (*p >= '0' && *p <= '9') digits[len++] = *p;
+    }
+    while (len > 1 && digits[len - 1] == '0') len--;
+    *point = atoi(p + 1) + 1;
+    return len;
+}
+
+/* digits[0..len-1], which are 0.d1d2... * 10^point, as described at the
+   top, after sign; returns the length */
+static int layout_digits(const char *digits, int len, int point, int neg, char *buf) {
+    char *p = buf;
+    int e = point - 1, i;
+
+    if (neg) *p++ = '-';
+    if (e < -4 || e >= 16) {
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            for (i = 1; i < len; i++) *p++ = digits[i];
+        }
+        *p++ = 'e';
+        *p++ = (e < 0) ? '-' : '+';
+        if (e < 0) e = -e;
+        if (e >= 100) *p++ = (char)('0' + e / 100);
+        *p++ = (char)('0' + e / 10 % 10);
+        *p++ = (char)('0' + e % 10);
+    } else if (point > 0) {
+        for (i = 0; i < point; i++) *p++ = i < len ? digits[i] : '0';
+        if (len > point) {
+            *p++ = '.';
+            for (; i < len; i++) *p++ = digits[i];
+        }
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        for (i = point; i < 0; i++) *p++ = '0';
+        for (i = 0; i < len; i++) *p++ = digits[i];
+    }
+    *p = '\0';
+    return (int)(p - buf);
+}
+
+/* All the digits of n, into buf (at least 32 bytes); returns the length */
+static int format_int(int64_t n, char *buf) {
+    int len = 0;
+    if (n < 0) buf[len++] = '-';
+    len += format_uint(n < 0 ? -(uint64_t)n : (uint64_t)n, buf + len);
+    buf[len] = '\0';
+    return len;
+}
+
+/* The text of x into buf (at least 32 bytes); returns its length */
+int format_number(double x, char *buf) {
+    char digits[20];
+    int len, point;
+
+    /* Whole numbers that are exact as doubles are the common case */
+    if (x > -9007199254740992.0 && x < 9007199254740992.0 && x == (int64_t)x) {
+        return format_int((int64_t)x, buf);
+    }
+    if (!isfinite(x)) return sprintf(buf, "%g", x);
+    len = shortest_grisu(fabs(x), digits, &point);
+    if (!len) len = shortest_libc(fabs(x), digits, &point);
+    return layout_digits(digits, len, point, x < 0, buf);
+}
+
+/* The text of a numeric value into buf (at least 32 bytes): an integer
+   exactly, whatever its size, a double by format_number() */
+int format_value(Value v, char *buf) {
+    if (VAL_TYPE(v) == VAL_INT) return format_int(INT_OF(v), buf);
+    return format_number(v.num, buf);
+}
+
+/* Whether ax * 10^d, for ax not negative, is exactly halfway between two
+   integers: that is, ax * 2 * 10^d is an odd integer. Worked out from the
+   lowest set bit of ax, since the product itself would be rounded. */
+static int is_half(double ax, int d) {
+    uint64_t m;
+    int e;
+    if (ax == 0 || !isfinite(ax)) return 0;
+    m = (uint64_t)ldexp(frexp(ax, &e), 53);
+    e -= 53;
+    while (!(m & 1)) {
+        m >>= 1;
+        e++;
+    }
+    /* ax = m * 2^e with m odd */
+    if (e != (d >= 0 ? -(d + 1) : -d - 1)) return 0;
+    for (; d < 0; d++) {
+        if (m % 5) return 0;
+        m /= 5;
+    }
+    return 1;
+}
+
+/* ax, which is not negative, rounded to decimals places as printf("%.*f")
+   would write it, except that a half is rounded up rather than to even;
+   returns the length. This scales by an exact power of ten when the
+   result is small enough for its rounding to be decided reliably and
+   leaves the rest to sprintf(). */
+static int format_fixed(double ax, int decimals, char *buf) {
+    double scaled, frac;
+    unsigned long r;
+    char digits[32];
+    int n, len;
+
+    /* Just above an exact half, so that every path below rounds it up */
+    if (is_half(ax, decimals)) ax = nextafter(ax, INFINITY);
+    if (decimals > 15 || !(ax * pow10_exact[decimals] < 1e9)) {
+        return sprintf(buf, "%.*f", decimals, ax);
+    }
+    scaled = ax * pow10_exact[decimals];
+    frac = scaled - floor(scaled);
+    if (fabs(frac - 0.5) < 1e-6) return sprintf(buf, "%.*f", decimals, ax);
+    r = (unsigned long)scaled + (frac > 0.5);
+    n = format_uint(r, digits);
+    while (n <= decimals) { /* At least one digit before the point */
+        memmove(digits + 1, digits, n++);
+        digits[0] = '0';
+    }
+    len = n - decimals;
+    memcpy(buf, digits, len);
+    if (decimals > 0) {
+        buf[len++] = '.';
+        memcpy(buf + len, digits + n - decimals, decimals);
+        len += decimals;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * PRINT USING. A format string is parsed once into a plan: a list of
+ * literal text runs and fields, cached on the USING token of the PRINT
+ * statement and reused for as long as the format string stays the same.
+ *
+ *   #  digit            .  decimal point      ,  thousands separators
+ *   +  sign (first or last)                   -  trailing minus
+ *   $$ floating dollar  ** asterisk fill      **$ both
+ *   ^^^^ exponent       !  first character    \  \ fixed-width string
+ *   &  whole string     _  next character literally
+ *
+ * Values are rendered straight into the output buffer (or a file's). A number too wide
+ * for its field is printed in full after a '%'.
+ */
+
+enum { USING_TEXT, USING_NUMBER, USING_STRING };
+
+/* Flags of a number field */
+#define USING_COMMA       0x01
+#define USING_PLUS        0x02 /* Leading '+': sign shown either way */
+#define USING_TRAIL_PLUS  0x04
+#define USING_TRAIL_MINUS 0x08
+#define USING_DOLLAR      0x10
+#define USING_STAR        0x20
+#define USING_POINT       0x40
+#define USING_EXP         0x80
+
+typedef struct {
+    unsigned char kind;
+    unsigned char flags;
+    short digits;   /* Number: positions before the point */
+    short decimals; /* Number: positions after the point */
+    int width;      /* Field: characters; 0 for '&' */
+    int start, len; /* Text: run of the plan's literal text */
+} UsingItem;
+
+struct UsingPlan {
+    char *source;   /* The format string this plan was made from */
+    size_t source_len;
+    char *text;     /* Literal text, '_' escapes resolved */
+    int count;
+    int fields;
+    int pos;        /* Item the next value continues from */
+    UsingItem items[];
+};
+
+/* Whether a number field starts at f[i] */
+static int number_field_at(const char *f, size_t i, size_t len) {
+    if (i < len && f[i] == '+') i++;
+    if (i >= len) return 0;
+    if (f[i] == '#') return 1;
+    if (f[i] == '.') return i + 1 < len && f[i + 1] == '#';
+    if (f[i] == '$' || f[i] == '*') return i + 1 < len && f[i + 1] == f[i];
+    return 0;
+}
+
+/* Parses a number field at f[*i] into it */
+static void parse_number_field(const char *f, size_t *i, size_t len, UsingItem *it) {
+    size_t j = *i;
+    it->kind = USING_NUMBER;
+    if (f[j] == '+') {
+        it->flags |= USING_PLUS;
+        j++;
+    }
+    if (f[j] == '*' && j + 1 < len && f[j + 1] == '*') {
+        it->flags |= USING_STAR;
+        it->digits += 2;
+        j += 2;
+        if (j < len && f[j] == '$') {
+            it->flags |= USING_DOLLAR;
+            j++;
+        }
+    } else if (f[j] == '$' && j + 1 < len && f[j + 1] == '$') {
+        it->flags |= USING_DOLLAR;
+        it->digits++;
+        j += 2;
+    }
+    while (j < len && (f[j] == '#' ||
+                       (f[j] == ',' && j + 1 < len && (f[j + 1] == '#' || f[j + 1] == ',' || f[j + 1] == '.')))) {
+        if (f[j] == '#') it->digits++;
+        else it->flags |= USING_COMMA;
+        j++;
+    }
+    if (j < len && f[j] == '.') {
+        it->flags |= USING_POINT;
+        j++;
+        while (j < len && f[j] == '#') {
+            it->decimals++;
+            j++;
+        }
+    }
+    if (j + 4 <= len && memcmp(f + j, "^^^^", 4) == 0) {
+        it->flags |= USING_EXP;
+        j += 4;
+        if (j < len && f[j] == '^') j++; /* Room for three exponent digits */
+    }
+    if (j < len && f[j] == '+' && !(it->flags & USING_PLUS)) {
+        it->flags |= USING_TRAIL_PLUS;
+        j++;
+    } else if (j < len && f[j] == '-' && !(it->flags & USING_PLUS)) {
+        it->flags |= USING_TRAIL_MINUS;
+        j++;
+    }
+    it->width = (int)(j - *i);
+    *i = j;
+}
+
+/* Index of the '\\' closing a "\\  \\" field opened at f[i], or 0 */
+static size_t string_field_end(const char *f, size_t i, size_t len) {
+    size_t j = i + 1;
+    while (j < len && f[j] == ' ') j++;
+    return (j < len && f[j] == '\\') ? j : 0;
+}
+
+static struct UsingPlan *parse_using(const char *f, size_t len) {
+    struct UsingPlan *plan = malloc(sizeof(struct UsingPlan) + (len + 1) * sizeof(UsingItem));
+    size_t i = 0;
+    int text_len = 0;
+
+    if (!plan) error("Out of memory");
+    plan->source = malloc(len + 1);
+    plan->text = malloc(len + 1);
+    if (!plan->source || !plan->text) error("Out of memory");
+    memcpy(plan->source, f, len);
+    plan->source_len = len;
+    plan->count = plan->fields = plan->pos = 0;
+
+    while (i < len) {
+        UsingItem *it = &plan->items[plan->count];
+        size_t j;
+        memset(it, 0, sizeof(*it));
+        if (f[i] == '!' || f[i] == '&') {
+            it->kind = USING_STRING;
+            it->width = (f[i] == '!');
+            i++;
+        } else if (f[i] == '\\' && (j = string_field_end(f, i, len)) > 0) {
+            it->kind = USING_STRING;
+            it->width = (int)(j - i + 1);
+            i = j + 1;
+        } else if (number_field_at(f, i, len)) {
+            parse_number_field(f, &i, len, it);
+        } else {
+            /* Literal text; extend the previous run if there is one */
+            if (f[i] == '_' && i + 1 < len) i++;
+            if (plan->count > 0 && it[-1].kind == USING_TEXT) {
+                it[-1].len++;
+            } else {
+                it->kind = USING_TEXT;
+                it->start = text_len;
+                it->len = 1;
+                plan->count++;
+            }
+            plan->text[text_len++] = f[i++];
+            continue;
+        }
+        plan->count++;
+        plan->fields++;
+    }
+    if (plan->fields == 0) {
+        using_free(plan);
+        error("No fields in PRINT USING format");
+    }
+    return plan;
+}
+
+/* The plan for format text, reusing the cached one when the text is the
+   same. Every PRINT USING statement starts at the first field. */
+struct UsingPlan *using_plan(struct UsingPlan *cached, const char *format, size_t len) {
+    struct UsingPlan *plan;
+    if (cached && cached->source_len == len && memcmp(cached->source, format, len) == 0) {
+        cached->pos = 0;
+        return cached;
+    }
+    plan = parse_using(format, len);
+    using_free(cached);
+    return plan;
+}
+
+void using_free(struct UsingPlan *plan) {
+    if (!plan) return;
+    free(plan->source);
+    free(plan->text);
+    free(plan);
+}
+
+/* Writes literal text from the current item up to the next field or the
+   end of the format; returns the characters written */
+int using_text(struct UsingPlan *plan, TextSink write) {
+    int written = 0;
+    while (plan->pos < plan->count && plan->items[plan->pos].kind == USING_TEXT) {
+        const UsingItem *it = &plan->items[plan->pos++];
+        write(plan->text + it->start, it->len);
+        written += it->len;
+    }
+    return written;
+}
+
+/* x in a number field, into buf; returns the length. digits is scratch
+   space for the digits of x. */
+static int render_number(const UsingItem *it, double x, char *buf, char *digits) {
+    int neg = x < 0, trail = 0, len = 0, n, ilen, i, avail, lead_zero, e = 0;
+    double ax = fabs(x);
+    char sign = 0;
+
+    if (!isfinite(x)) {
+        buf[0] = '%';
+        return 1 + format_number(x, buf + 1);
+    }
+
+    if (it->flags & USING_PLUS) sign = neg ? '-' : '+';
+    else if (it->flags & USING_TRAIL_PLUS) trail = neg ? '-' : '+';
+    else if (it->flags & USING_TRAIL_MINUS) trail = neg ? '-' : ' ';
+    else if (neg) sign = '-';
+    avail = it->width - (trail != 0);
+
+    if (it->flags & USING_EXP) {
+        /* Mantissa with as many digits before the point as there are
+           positions, less one kept for the sign if it has no + or - */
+        int k = it->digits - !(it->flags & (USING_PLUS | USING_TRAIL_PLUS | USING_TRAIL_MINUS));
+        int sig;
+        if (k < 0) k = 0;
+        sig = k + it->decimals;
+        if (sig < 1) sig = 1;
+        if (ax == 0) {
+            memset(digits, '0', sig);
+        } else {
+            char *p;
+            sprintf(digits, "%.*e", sig - 1, ax);
+            p = strchr(digits, 'e');
+            if (is_half(ax, sig - 1 - atoi(p + 1))) {
+                /* Round the half up, not to even */
+                sprintf(digits, "%.*e", sig - 1, nextafter(ax, INFINITY));
+                p = strchr(digits, 'e');
+            }
+            e = atoi(p + 1) + 1 - k;
+            if (sig > 1) memmove(digits + 1, digits + 2, sig - 1); /* Drop the point */
+        }
+        ilen = k;
+        lead_zero = 0;
+    } else {
+        n = format_fixed(ax, it->decimals, digits);
+        ilen = it->decimals > 0 ? n - it->decimals - 1 : n;
+        if (it->decimals > 0) memmove(digits + ilen, digits + ilen + 1, it->decimals);
+        /* ".##" has no place for the zero of 0.5, and gives it up if short of room */
+        lead_zero = (ilen == 1 && digits[0] == '0');
+    }
+
+    for (;;) {
+        len = 0;
+        if (sign) buf[len++] = sign;
+        if ((it->flags & USING_DOLLAR) && !(it->flags & USING_EXP)) buf[len++] = '$';
+        if (!(lead_zero && (it->digits == 0 || lead_zero > 1))) {
+            for (i = 0; i < ilen; i++) {
+                if ((it->flags & USING_COMMA) && i > 0 && (ilen - i) % 3 == 0) buf[len++] = ',';
+                buf[len++] = digits[i];
+            }
+        }
+        if (it->flags & USING_POINT) {
+            buf[len++] = '.';
+            memcpy(buf + len, digits + ilen, it->decimals);
+            len += it->decimals;
+        }
+        if (it->flags & USING_EXP) {
+            len += sprintf(buf + len, "E%c%02d", e < 0 ? '-' : '+', e < 0 ? -e : e);
+        }
+        if (len <= avail || lead_zero != 1) break;
+        lead_zero = 2; /* Try again without the zero */
+    }
+
+    if (len > avail) {
+        /* Too wide: the whole number after a '%' */
+        memmove(buf + 1, buf, len);
+        buf[0] = '%';
+        len++;
+    } else if (len < avail) {
+        memmove(buf + avail - len, buf, len);
+        memset(buf, (it->flags & USING_STAR) ? '*' : ' ', avail - len);
+        len = avail;
+    }
+    if (trail) buf[len++] = (char)trail;
+    return len;
+}
+
+/* Writes the literal text up to the next field and v in that field,
+   wrapping round to the start of the format when it runs out of fields;
+   returns the characters written */
+int using_field(struct UsingPlan *plan, Value v, TextSink write) {
+    int written = using_text(plan, write);
+    const UsingItem *it;
+
+    if (plan->pos == plan->count) {
+        plan->pos = 0;
+        written += using_text(plan, write);
+    }
+    it = &plan->items[plan->pos++];
+
+    if (it->kind == USING_STRING) {
+        size_t len = 0;
+        const char *text;
+        if (VAL_TYPE(v) != VAL_STR) error("Type mismatch: Expected string");
+        text = str_data(&v);
+        len = str_len(&v);
+        if (it->width == 0) {
+            write(text, len);
+            return written + (int)len;
+        }
+        if (len > (size_t)it->width) len = it->width;
+        write(text, len);
+        while (len < (size_t)it->width) {
+            static const char spaces[] = "                ";
+            size_t n = it->width - len < 16 ? it->width - len : 16;
+            write(spaces, n);
+            len += n;
+        }
+        return written + it->width;
+    } else {
+        /* Room for the 309 integer digits of the largest double, their
+           commas, the decimals, the sign, '$' and exponent, and padding */
+        char *buf, *digits;
+        int len;
+        if (VAL_TYPE(v) == VAL_STR) error("Type mismatch: Expected number");
+        buf = temp_alloc((size_t)it->width + it->decimals + 448);
+        digits = temp_alloc((size_t)it->width + it->decimals + 336);
+        len = render_number(it, NUM_OF(v), buf, digits);
+        write(buf, len);
+        return written + len;
+    }
+}
+
+/* format_number() with its digits found by sprintf() and strtod() alone,
+   for the benchmark */
+static int format_libc(double x, char *buf) {
+    char digits[20];
+    int len, point;
+    if (x == 0) return sprintf(buf, "0");
+    if (!isfinite(x)) return sprintf(buf, "%g", x);
+    len = shortest_libc(fabs(x), digits, &point);
+    return layout_digits(digits, len, point, x < 0, buf);
+}
+
+/* Micro-benchmark: format a mix of whole numbers, fractions, large and
+   small magnitudes and arbitrary bit patterns with format_number() and
+   with format_libc(), checking that both give the same text
+   (--bench-format). */
+void bench_format(void) {
+    enum { COUNT = 100000, PASSES = 20 };
+    double *values = malloc(COUNT * sizeof(double));
+    char a[32], b[32];
+    int i, pass, mode, mismatches = 0;
+
+    if (!values) error("Out of memory");
+    srand(1);
+    for (i = 0; i < COUNT; i++) {
+        double r = (double)rand() / RAND_MAX;
+        uint64_t bits = 0;
+        int j;
+        switch (i % 5) {
+            case 0: values[i] = (double)(rand() % 20000 - 10000); break;
+            case 1: values[i] = floor(r * 100000) / 100; break;
+            case 2: values[i] = (r - 0.5) * pow(10, rand() % 30 - 15); break;
+            case 3: values[i] = r * 1e9; break;
+            default:
+                do {
+                    for (j = 0; j < 4; j++) bits = bits << 16 | (uint64_t)(rand() & 0xFFFF);
+                    memcpy(&values[i], &bits, sizeof bits);
+                } while (!isfinite(values[i]));
+                break;
+        }
+    }
+    for (i = 0; i < COUNT; i++) {
+        format_number(values[i], a);
+        format_libc(values[i], b);
+        if (strcmp(a, b) != 0 && mismatches++ < 5) {
+            printf("mismatch: %.17g gives %s, libc %s\n", values[i], a, b);
+        }
+    }
+    printf("%d numbers, %d passes, %d mismatches\n", COUNT, PASSES, mismatches);
+
+    for (mode = 0; mode < 2; mode++) {
+        clock_t start = clock();
+        double secs;
+        for (pass = 0; pass < PASSES; pass++) {
+            for (i = 0; i < COUNT; i++) {
+                if (mode) format_libc(values[i], a);
+                else format_number(values[i], a);
+            }
+        }
+        secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        printf("%-15s %8.1f ns/number\n", mode ? "format_libc:" : "format_number:",
+               secs * 1e9 / ((double)COUNT * PASSES));
+    }
+    free(values);
+}
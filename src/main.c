@@ -2,40 +2,52 @@
 #include <time.h>
 
 /* Global definitions */
-Line program[MAX_LINES];
+static Line program_init[INIT_LINES];
+Line *program = program_init;
 int program_line_count = 0;
-Variable variables[100];
+int program_cap = INIT_LINES;
+unsigned program_generation = 1;
+Variable *variables = NULL;
 int var_count = 0;
-Array arrays[MAX_ARRAYS];
+static Array arrays_init[INIT_ARRAYS];
+Array *arrays = arrays_init;
 int array_count = 0;
 UserFunc user_functions[26];
-ForLoop for_stack[STACK_SIZE];
+static ForLoop for_stack_init[INIT_STACK];
+ForLoop *for_stack = for_stack_init;
 int for_sp = 0;
-GosubFrame gosub_stack[STACK_SIZE];
+int for_cap = INIT_STACK;
+static GosubFrame gosub_stack_init[INIT_STACK];
+GosubFrame *gosub_stack = gosub_stack_init;
 int gosub_sp = 0;
+int gosub_cap = INIT_STACK;
 int current_line_idx = 0;
 int execution_finished = 0;
 
 /* Data pointer globals */
 int data_line_idx = 0;
-char *data_ptr = NULL;
+Token *data_ptr = NULL;
 
-char *jump_to_ptr = NULL;
+Token *jump_to_ptr = NULL;
 
 jmp_buf error_jmp;
 int interactive_mode_active = 0;
+int vm_enabled = 1;
+static int show_stats = 0; /* --stats: report load time */
 
 /* Lexer definitions */
-char *token_ptr = NULL;
+Token *token_ptr = NULL;
 BasTokenType current_token = TOK_NONE;
 double token_number = 0.0;
-char token_string[MAX_LINE_LEN];
+const char *token_string = NULL;
+Token *token_cur = NULL;
 
 /* History for interactive mode */
 static char *history[HISTORY_SIZE];
 static int history_count = 0;
 static int history_idx = 0; // Current position in history when navigating
 void error(const char *msg) {
+    out_flush(); /* The message comes after the output that led to it */
     if (current_line_idx >= 0 && current_line_idx < program_line_count) {
         fprintf(stderr, "Error in line %d: %s\n", program[current_line_idx].number, msg);
     } else {
@@ -49,6 +61,84 @@ void error(const char *msg) {
     exit(1);
 }
 
+/* Double the capacity of a container that started out in static storage
+   of initial_cap items; the first growth copies it to the heap. */
+void *grow_storage(void *items, int *cap, int initial_cap, size_t item_size) {
+    int new_cap = *cap * 2;
+    void *grown;
+    if (*cap == initial_cap) {
+        grown = malloc((size_t)new_cap * item_size);
+        if (grown) memcpy(grown, items, (size_t)*cap * item_size);
+    } else {
+        grown = realloc(items, (size_t)new_cap * item_size);
+    }
+    if (!grown) error("Out of memory");
+    *cap = new_cap;
+    return grown;
+}
+
+/* Arena for expression temporaries. Everything allocated from it lives
+   until the end of the statement being executed, when temp_reset() takes
+   it all back at once; nothing in it is freed individually, and nothing
+   leaks when error() abandons a statement halfway. */
+#define TEMP_BLOCK 16384
+
+typedef struct TempBlock {
+    struct TempBlock *next; /* Older block */
+    size_t size, used;
+    double data[1];         /* Aligned for anything stored in it */
+} TempBlock;
+
+static TempBlock *temp_blocks = NULL;
+
+void *temp_alloc(size_t size) {
+    void *p;
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    if (!temp_blocks || temp_blocks->size - temp_blocks->used < size) {
+        size_t block_size = size > TEMP_BLOCK ? size : TEMP_BLOCK;
+        TempBlock *block = malloc(sizeof(TempBlock) + block_size);
+        if (!block) error("Out of memory");
+        block->next = temp_blocks;
+        block->size = block_size;
+        block->used = 0;
+        temp_blocks = block;
+    }
+    p = (char *)temp_blocks->data + temp_blocks->used;
+    temp_blocks->used += size;
+    return p;
+}
+
+/* Called between statements. Keeps the oldest block for the next one. */
+void temp_reset(void) {
+    if (!temp_blocks) return;
+    while (temp_blocks->next) {
+        TempBlock *older = temp_blocks->next;
+        free(temp_blocks);
+        temp_blocks = older;
+    }
+    temp_blocks->used = 0;
+}
+
+/* fgets() into a buffer that grows to hold the whole line. Returns NULL at
+   end of file, otherwise *buf (which keeps the newline, like fgets). */
+char *read_line(FILE *fp, char **buf, size_t *cap) {
+    size_t len = 0;
+    if (!*buf) {
+        *cap = 256;
+        *buf = malloc(*cap);
+        if (!*buf) error("Out of memory");
+    }
+    while (fgets(*buf + len, (int)(*cap - len), fp)) {
+        len += strlen(*buf + len);
+        if (len > 0 && (*buf)[len - 1] == '\n') return *buf;
+        if (len + 1 < *cap) return *buf; /* Last line, no newline */
+        *cap *= 2;
+        *buf = realloc(*buf, *cap);
+        if (!*buf) error("Out of memory");
+    }
+    return len > 0 ? *buf : NULL;
+}
+
 // Adds a command to history, managing the buffer as a circular queue
 void add_to_history(const char *command) {
     if (strlen(command) == 0) return; // Don't add empty commands
@@ -178,11 +268,57 @@ char *read_line_with_history(const char *prompt) {
     return line_buffer;
 }
 
+/* Add, replace or (when text is empty) delete a numbered line */
+static void store_line(int line_num, const char *text) {
+    int i = find_line_index(line_num);
+    if (i >= 0) {
+        free(program[i].text);
+        free_tokens(program[i].tokens);
+        if (*text == '\0') {
+            /* Delete line */
+            int j;
+            for (j = i; j < program_line_count - 1; j++) {
+                program[j] = program[j+1];
+            }
+            program_line_count--;
+            program_generation++;
+        } else {
+            /* Replace line */
+            program[i].text = (char *)malloc(strlen(text) + 1);
+            strcpy(program[i].text, text);
+            program[i].tokens = crunch_line(text);
+        }
+        return;
+    }
+
+    /* Add new line */
+    if (*text == '\0') return; /* Nothing to add */
+    
+    if (program_line_count == program_cap) {
+        program = grow_storage(program, &program_cap, INIT_LINES, sizeof(Line));
+    }
+    {
+        /* Insert in order, keeping program[] sorted */
+        int lo = 0, hi = program_line_count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (program[mid].number < line_num) lo = mid + 1;
+            else hi = mid;
+        }
+        memmove(&program[lo + 1], &program[lo], (program_line_count - lo) * sizeof(Line));
+        program[lo].number = line_num;
+        program[lo].text = (char *)malloc(strlen(text) + 1);
+        strcpy(program[lo].text, text);
+        program[lo].tokens = crunch_line(text);
+        program_line_count++;
+        program_generation++;
+    }
+}
+
 void process_line(char *buffer) {
     int line_num;
     char *text_start;
     char *p = buffer;
-    int i;
     
     while (*p && isspace(*p)) p++;
     if (!*p) return;
@@ -200,98 +336,172 @@ void process_line(char *buffer) {
             p--;
         }
 
-        /* Check if line exists */
-        for (i = 0; i < program_line_count; i++) {
-            if (program[i].number == line_num) {
-                free(program[i].text);
-                if (*text_start == '\0') {
-                    /* Delete line */
-                    int j;
-                    for (j = i; j < program_line_count - 1; j++) {
-                        program[j] = program[j+1];
-                    }
-                    program_line_count--;
-                } else {
-                    /* Replace line */
-                    program[i].text = (char *)malloc(strlen(text_start) + 1);
-                    strcpy(program[i].text, text_start);
-                }
-                return;
-            }
-        }
-
-        /* Add new line */
-        if (*text_start == '\0') return; /* Nothing to add */
-        
-        if (program_line_count < MAX_LINES) {
-            program[program_line_count].number = line_num;
-            program[program_line_count].text = (char *)malloc(strlen(text_start) + 1);
-            strcpy(program[program_line_count].text, text_start);
-            program_line_count++;
-            sort_program();
-        } else {
-            fprintf(stderr, "Program too large\n");
-        }
+        store_line(line_num, text_start);
     } else {
         /* Immediate mode execution */
         // The read_line_with_history function already ensures no trailing newline
         
+        static Token *immediate_tokens = NULL;
+
         current_line_idx = -1; /* Special value for immediate mode? */
-        init_tokenizer(buffer);
+        free_tokens(immediate_tokens);
+        immediate_tokens = crunch_line(buffer);
+        init_tokenizer(immediate_tokens);
         while (current_token != TOK_EOL && current_token != TOK_EOF) {
+            temp_reset();
             exec_statement();
             if (current_token == TOK_COLON) next_token();
         }
     }
 }
 
+/* A numbered line read by load_program(), not yet stored */
+typedef struct {
+    int number;
+    int seq;          /* Position in the file */
+    const char *text; /* Points into the file buffer; "" deletes the line */
+} PendingLine;
+
+/* By line number, then file order, so the last definition of a number
+   comes last in its run no matter how qsort() orders equal keys */
+static int compare_pending(const void *a, const void *b) {
+    const PendingLine *x = a, *y = b;
+    if (x->number != y->number) return x->number < y->number ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/* Sort the pending lines once and store the last definition of each number */
+static int store_pending(PendingLine *pending, int count) {
+    int i, stored = 0;
+    int append = (program_line_count == 0);
+
+    if (count == 0) return 0;
+    qsort(pending, count, sizeof(PendingLine), compare_pending);
+    for (i = 0; i < count; i++) {
+        const char *text = pending[i].text;
+        if (i + 1 < count && pending[i + 1].number == pending[i].number) continue;
+        if (!append) {
+            /* Lines already stored (an immediate command in the file ran
+               first): fall back to the general path. */
+            store_line(pending[i].number, text);
+            continue;
+        }
+        if (*text == '\0') continue;
+        if (program_line_count == program_cap) {
+            program = grow_storage(program, &program_cap, INIT_LINES, sizeof(Line));
+        }
+        program[program_line_count].number = pending[i].number;
+        program[program_line_count].text = (char *)malloc(strlen(text) + 1);
+        strcpy(program[program_line_count].text, text);
+        program[program_line_count].tokens = crunch_line(text);
+        program_line_count++;
+        stored++;
+    }
+    if (stored) program_generation++;
+    return stored;
+}
+
+/* Read a whole file into a NUL-terminated buffer with as few reads as possible */
+static char *read_file(FILE *fp, size_t *len) {
+    size_t cap = 65536, n = 0, got;
+    long size;
+    char *buf;
+
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0) {
+        cap = (size_t)size + 1;
+    }
+    rewind(fp);
+    buf = malloc(cap + 1);
+    if (!buf) error("Out of memory");
+    while ((got = fread(buf + n, 1, cap - n, fp)) > 0) {
+        n += got;
+        if (n == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap + 1);
+            if (!buf) error("Out of memory");
+        }
+    }
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
+
 void load_program(const char *filename) {
     FILE *fp;
-    char buffer[MAX_LINE_LEN];
-    char path[MAX_LINE_LEN];
-    int first_line = 1;
+    char *buffer, *p;
+    size_t size;
+    PendingLine *pending = NULL;
+    int pending_count = 0, pending_cap = 0, total_lines = 0;
+    clock_t start = clock(), read_done;
 
     /* Try to open the file as is */
-    fp = fopen(filename, "r");
+    fp = fopen(filename, "rb");
     if (!fp) {
         /* Try with .bas extension */
-        strcpy(path, filename);
-        ensure_extension(path);
-        fp = fopen(path, "r");
+        char *path = with_extension(filename);
+        fp = fopen(path, "rb");
+        free(path);
     }
     
     if (!fp) {
         fprintf(stderr, "Could not open file %s\n", filename);
         exit(1);
     }
+    buffer = read_file(fp, &size);
+    fclose(fp);
+    read_done = clock();
 
-    while (fgets(buffer, MAX_LINE_LEN, fp)) {
-        if (first_line) {
-            first_line = 0;
-            if (buffer[0] == '#') continue; 
-        }
-        process_line(buffer);
+    p = buffer;
+    /* Skip a shebang line */
+    if (*p == '#') {
+        while (*p && *p != '\n') p++;
     }
-    fclose(fp);
-}
+    while (*p) {
+        char *line = p, *end;
+        while (*p && *p != '\n') p++;
+        end = p;
+        if (*p) *p++ = '\0';
+        total_lines++;
 
-void sort_program(void) {
-    int i, j;
-    Line temp;
-    
-    for (i = 0; i < program_line_count - 1; i++) {
-        for (j = 0; j < program_line_count - i - 1; j++) {
-            if (program[j].number > program[j + 1].number) {
-                temp = program[j];
-                program[j] = program[j + 1];
-                program[j + 1] = temp;
-            }
+        while (*line && isspace((unsigned char)*line)) line++;
+        if (!*line) continue;
+        if (!isdigit((unsigned char)*line)) {
+            /* An immediate command: store what came before it, then run it */
+            store_pending(pending, pending_count);
+            pending_count = 0;
+            process_line(line);
+            continue;
+        }
+
+        if (pending_count == pending_cap) {
+            pending_cap = pending_cap ? pending_cap * 2 : 1024;
+            pending = realloc(pending, pending_cap * sizeof(PendingLine));
+            if (!pending) error("Out of memory");
         }
+        pending[pending_count].number = atoi(line);
+        pending[pending_count].seq = pending_count;
+        while (isdigit((unsigned char)*line)) line++;
+        while (*line && isspace((unsigned char)*line)) line++;
+        /* Strip trailing newlines */
+        while (end > line && (end[-1] == '\r' || end[-1] == '\n')) *--end = '\0';
+        pending[pending_count].text = line;
+        pending_count++;
     }
+    store_pending(pending, pending_count);
+
+    if (show_stats) {
+        double read_ms = (double)(read_done - start) * 1000.0 / CLOCKS_PER_SEC;
+        double total_ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+        fprintf(stderr, "Loaded %s: %lu bytes, %d lines, %d stored in %.2f ms (read %.2f ms)\n",
+                filename, (unsigned long)size, total_lines, program_line_count, total_ms, read_ms);
+    }
+    free(pending);
+    free(buffer);
 }
 
 void interactive_mode(void) {
-    char buffer[MAX_LINE_LEN];
+    static char *buffer = NULL; /* Static: it must survive the longjmp */
+    static size_t buffer_cap = 0;
 	#ifdef _WIN32
     system("cls");
 	#else
@@ -309,22 +519,44 @@ void interactive_mode(void) {
     /* Don't clear variables, users want to inspect them */
     
     while (1) {
+        out_flush();
         printf("] ");
-        if (!fgets(buffer, MAX_LINE_LEN, stdin)) break;
+        if (!read_line(stdin, &buffer, &buffer_cap)) break;
         
         process_line(buffer);
     }
 }
 
 int main(int argc, char **argv) {
+    const char *filename = NULL;
+    int i;
+
     srand(time(NULL));
+    atexit(out_flush);
+    atexit(close_files);
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tree") == 0) {
+            vm_enabled = 0; /* Use the tree-walking evaluator */
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--bench-lex") == 0) {
+            bench_lexer(argc - i - 1, argv + i + 1);
+            return 0;
+        } else if (strcmp(argv[i], "--bench-format") == 0) {
+            bench_format();
+            return 0;
+        } else if (!filename) {
+            filename = argv[i];
+        }
+    }
 
-    if (argc < 2) {
+    if (!filename) {
         interactive_mode();
         return 0;
     }
 
-    load_program(argv[1]);
+    load_program(filename);
     run_program();
 
     return 0;
@@ -344,15 +576,17 @@ void run_program(void) {
             next_token();
             jump_to_ptr = NULL;
         } else {
-            init_tokenizer(program[current_line_idx].text);
+            init_tokenizer(program[current_line_idx].tokens);
         }
         
         while (current_token != TOK_EOL && current_token != TOK_EOF && !execution_finished) {
             int entry_line_idx = current_line_idx;
             
+            temp_reset();
             exec_statement();
             
-            if (current_line_idx != entry_line_idx) break;
+            /* A jump, or NEXT going back within this line */
+            if (current_line_idx != entry_line_idx || jump_to_ptr != NULL) break;
             
             if (current_token == TOK_COLON) {
                 next_token();
@@ -364,5 +598,6 @@ void run_program(void) {
             current_line_idx++;
         }
     }
+    close_files();
     restore_terminal();
 }
@@ -0,0 +1,66 @@
+#include "bas.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define STDOUT_FILENO 1
+#endif
+
+/* Program output. PRINT and the INPUT prompt write into out_buf, which
+   goes to stdout only when it fills up or at a flush point: before the
+   program reads the keyboard (INPUT, INKEY$, the line editor) or sleeps,
+   before an error message, at exit and, when stdout is a terminal, at the
+   end of every line. Output to a file or a pipe is thus written in
+   OUT_BUF_SIZE blocks rather than an item or a line at a time.
+
+   Anything else that writes to stdout directly (LIST, FILES, CLS) calls
+   out_flush() first so the two streams stay in order. */
+
+#define OUT_BUF_SIZE 65536
+
+static char out_buf[OUT_BUF_SIZE];
+static size_t out_len = 0;
+static int out_tty = -1; /* Whether stdout is a terminal; -1 until known */
+
+void out_flush(void) {
+    if (out_len > 0) {
+        fwrite(out_buf, 1, out_len, stdout);
+        out_len = 0;
+    }
+    fflush(stdout);
+}
+
+void out_write(const char *text, size_t len) {
+    if (len > OUT_BUF_SIZE - out_len) {
+        out_flush();
+        if (len >= OUT_BUF_SIZE) {
+            fwrite(text, 1, len, stdout);
+            return;
+        }
+    }
+    memcpy(out_buf + out_len, text, len);
+    out_len += len;
+}
+
+void out_char(char c) {
+    if (out_len == OUT_BUF_SIZE) out_flush();
+    out_buf[out_len++] = c;
+}
+
+void out_spaces(int n) {
+    while (n > 0) {
+        int chunk;
+        if (out_len == OUT_BUF_SIZE) out_flush();
+        chunk = (int)(OUT_BUF_SIZE - out_len) < n ? (int)(OUT_BUF_SIZE - out_len) : n;
+        memset(out_buf + out_len, ' ', chunk);
+        out_len += chunk;
+        n -= chunk;
+    }
+}
+
+/* End a line of output; a terminal sees it straight away */
+void out_newline(void) {
+    out_char('\n');
+    if (out_tty < 0) out_tty = isatty(STDOUT_FILENO);
+    if (out_tty) out_flush();
+}
@@ -0,0 +1,433 @@
+#include "bas.h"
+
+/* String values are reference counted and never modified once they are
+   shared, so reading a variable, copying it into an array cell or passing
+   it through an expression only moves a pointer. Whatever stores a String
+   (a variable, an array cell or a compiled literal) owns one reference and
+   gives it back with str_unref(). A NULL String reads as "".
+
+   Expression temporaries own nothing. They borrow the strings of the
+   variables, cells and literals they were read from, which cannot change
+   before the statement ends, and strings built while evaluating (by
+   concatenation, say) are allocated from the temp_alloc() arena. Storing a
+   temporary goes through keep_value(), which takes a reference or copies
+   the string out of the arena.
+
+   A string Value of up to STR_INLINE characters keeps them inside the
+   Value itself and owns no String at all, so the short strings most
+   programs juggle (CHR$, INKEY$, single characters from MID$) never touch
+   the allocator. A longer one is a view of len characters at offset off in
+   its String, so MID$, LEFT$ and RIGHT$ share their argument's text
+   instead of copying it.
+
+   With BAS_NAN_BOX a Value is only a tagged String pointer, so there is no
+   room for inline text or views: short results come from a table of
+   shared one-character strings, and slices are copied. */
+
+String *str_new(const char *text, size_t len) {
+    String *s = malloc(sizeof(String) + len + 1);
+    if (!s) error("Out of memory");
+    s->refs = 1;
+    s->len = len;
+    s->cap = len;
+    memcpy(s->text, text, len);
+    s->text[len] = '\0';
+    return s;
+}
+
+/* A temporary string of len characters, for the caller to fill in */
+static String *temp_string(size_t len) {
+    String *s = temp_alloc(sizeof(String) + len + 1);
+    s->refs = 0;
+    s->len = len;
+    s->cap = len;
+    s->text[len] = '\0';
+    return s;
+}
+
+String *str_ref(String *s) {
+    if (s) s->refs++;
+    return s;
+}
+
+void str_unref(String *s) {
+    if (s && --s->refs == 0) free(s);
+}
+
+#ifndef BAS_NAN_BOX
+
+/* A value holding all of s, which is longer than STR_INLINE */
+static Value heap_value(String *s) {
+    Value v;
+    v.h.type = VAL_STR;
+    v.h.len = (unsigned)s->len;
+    v.h.s.ref.str = s;
+    v.h.s.ref.off = 0;
+    return v;
+}
+
+/* A temporary string value holding a copy of text */
+Value str_make(const char *text, size_t len) {
+    Value v;
+    if (len > STR_INLINE) {
+        String *s = temp_string(len);
+        memcpy(s->text, text, len);
+        return heap_value(s);
+    }
+    v.h.type = VAL_STR;
+    v.h.len = (unsigned)len;
+    memcpy(v.h.s.text, text, len);
+    v.h.s.text[len] = '\0';
+    return v;
+}
+
+/* A temporary string value borrowing s (a short one is simply copied) */
+Value str_share(String *s) {
+    if (!s || s->len <= STR_INLINE) return str_make(s ? s->text : "", s ? s->len : 0);
+    return heap_value(s);
+}
+
+/* Characters of a string value; a view's text is not NUL-terminated */
+const char *str_data(const Value *v) {
+    if (v->h.len <= STR_INLINE) return v->h.s.text;
+    return v->h.s.ref.str->text + v->h.s.ref.off;
+}
+
+size_t str_len(const Value *v) {
+    return v->h.len;
+}
+
+/* Characters start .. start+len-1 of v */
+Value str_slice(Value v, size_t start, size_t len) {
+    if (v.h.len > STR_INLINE && len > STR_INLINE) {
+        v.h.s.ref.off += (unsigned)start;
+        v.h.len = (unsigned)len;
+        return v;
+    }
+    return str_make(str_data(&v) + start, len);
+}
+
+/* A string holding exactly the text of v, for storing in an array cell.
+   A view is copied, so that the cell does not keep the whole of a longer
+   string alive. */
+String *str_detach(Value v) {
+    String *s;
+    if (v.h.len == 0) return NULL;
+    s = (v.h.len > STR_INLINE) ? v.h.s.ref.str : NULL;
+    if (s && s->refs > 0 && v.h.len == s->len) return str_ref(s);
+    return str_new(str_data(&v), v.h.len);
+}
+
+/* a followed by b */
+Value str_concat(Value a, Value b) {
+    String *s;
+    if (b.h.len == 0) return a;
+    if (a.h.len == 0) return b;
+    if (a.h.len + b.h.len <= STR_INLINE) {
+        memcpy(a.h.s.text + a.h.len, b.h.s.text, b.h.len);
+        a.h.len += b.h.len;
+        a.h.s.text[a.h.len] = '\0';
+        return a;
+    }
+    if ((size_t)a.h.len + b.h.len > INT_MAX) error("String too long");
+    s = temp_string((size_t)a.h.len + b.h.len);
+    memcpy(s->text, str_data(&a), a.h.len);
+    memcpy(s->text + a.h.len, str_data(&b), b.h.len);
+    return heap_value(s);
+}
+
+/* Append text to the stored string value *v. An unshared string is extended in
+   place, and grows by doubling when it runs out of room, so appending to
+   the same string again and again costs amortized O(1) per character. A
+   shared string or a view is copied first (copy-on-write). */
+void str_append(Value *v, const char *text, size_t len) {
+    size_t old_len = v->h.len, new_len = old_len + len, cap;
+    String *s = (old_len > STR_INLINE) ? v->h.s.ref.str : NULL;
+    int owned = s && s->refs == 1 && v->h.s.ref.off == 0 && old_len == s->len;
+    String *grown;
+
+    if (len == 0) return;
+    if (new_len <= STR_INLINE) {
+        memcpy(v->h.s.text + old_len, text, len);
+        v->h.s.text[new_len] = '\0';
+        v->h.len = (unsigned)new_len;
+        return;
+    }
+
+    if (owned && s->cap >= new_len) {
+        grown = s;
+    } else {
+        cap = new_len;
+        if (cap < old_len * 2) cap = old_len * 2;
+        if (cap > INT_MAX) error("String too long");
+        grown = malloc(sizeof(String) + cap + 1);
+        if (!grown) {
+            error("Out of memory");
+            return;
+        }
+        grown->refs = 1;
+        grown->cap = cap;
+        memcpy(grown->text, str_data(v), old_len);
+    }
+    memcpy(grown->text + old_len, text, len);
+    grown->len = new_len;
+    grown->text[new_len] = '\0';
+    if (grown != s) str_unref(s); /* Only now: text may point into s */
+    v->h.len = (unsigned)new_len;
+    v->h.s.ref.str = grown;
+    v->h.s.ref.off = 0;
+}
+
+/* A temporary in the form it is stored in a variable: holding its own
+   reference to a long string, which is copied if it is in the arena */
+Value keep_value(Value v) {
+    String *s;
+    if (v.h.type != VAL_STR || v.h.len <= STR_INLINE) return v;
+    s = v.h.s.ref.str;
+    if (s->refs == 0) {
+        s = str_new(str_data(&v), v.h.len);
+        v.h.s.ref.off = 0;
+        v.h.s.ref.str = s;
+    } else {
+        str_ref(s);
+    }
+    return v;
+}
+
+/* Give back the string a stored value holds, if any */
+void drop_value(Value v) {
+    if (v.h.type == VAL_STR && v.h.len > STR_INLINE) str_unref(v.h.s.ref.str);
+}
+
+#else /* BAS_NAN_BOX */
+
+/* The String a string value points to */
+static String *unbox(const Value *v) {
+    return (String *)(uintptr_t)(v->bits & NAN_BOX_PTR);
+}
+
+static Value box(String *s) {
+    Value v;
+    v.bits = NAN_BOX_STR | (uint64_t)(uintptr_t)s;
+    return v;
+}
+
+/* "" and the 256 one-character strings, made on first use. The table keeps
+   a reference to each, so they are never freed. */
+static String *short_strings[257];
+
+static String *short_string(const char *text, size_t len) {
+    int i = len ? (unsigned char)text[0] : 256;
+    if (!short_strings[i]) short_strings[i] = str_new(text, len);
+    return short_strings[i];
+}
+
+/* A temporary string value holding a copy of text */
+Value str_make(const char *text, size_t len) {
+    String *s;
+    if (len <= 1) return box(short_string(text, len));
+    s = temp_string(len);
+    memcpy(s->text, text, len);
+    return box(s);
+}
+
+/* A temporary string value borrowing s */
+Value str_share(String *s) {
+    return s ? box(s) : box(short_string("", 0));
+}
+
+/* Characters of a string value, always NUL-terminated in this layout */
+const char *str_data(const Value *v) {
+    return unbox(v)->text;
+}
+
+size_t str_len(const Value *v) {
+    return unbox(v)->len;
+}
+
+/* Characters start .. start+len-1 of v */
+Value str_slice(Value v, size_t start, size_t len) {
+    if (start == 0 && len == str_len(&v)) return v;
+    return str_make(str_data(&v) + start, len);
+}
+
+/* A string holding exactly the text of v, for storing in an array cell */
+String *str_detach(Value v) {
+    String *s = unbox(&v);
+    if (s->len == 0) return NULL;
+    if (s->refs > 0) return str_ref(s);
+    return str_new(s->text, s->len);
+}
+
+/* a followed by b */
+Value str_concat(Value a, Value b) {
+    String *sa = unbox(&a), *sb = unbox(&b), *s;
+    if (sb->len == 0) return a;
+    if (sa->len == 0) return b;
+    if (sa->len + sb->len > INT_MAX) error("String too long");
+    s = temp_string(sa->len + sb->len);
+    memcpy(s->text, sa->text, sa->len);
+    memcpy(s->text + sa->len, sb->text, sb->len);
+    return box(s);
+}
+
+/* Append text to the stored string value *v, in place when the string is
+   unshared (the shared short strings never are), as above */
+void str_append(Value *v, const char *text, size_t len) {
+    String *s = unbox(v), *grown;
+    size_t old_len = s->len, new_len = old_len + len, cap;
+
+    if (len == 0) return;
+    if (s->refs == 1 && s->cap >= new_len) {
+        grown = s;
+    } else {
+        cap = new_len;
+        if (cap < old_len * 2) cap = old_len * 2;
+        if (cap > INT_MAX) error("String too long");
+        grown = malloc(sizeof(String) + cap + 1);
+        if (!grown) {
+            error("Out of memory");
+            return;
+        }
+        grown->refs = 1;
+        grown->cap = cap;
+        memcpy(grown->text, s->text, old_len);
+    }
+    memcpy(grown->text + old_len, text, len);
+    grown->len = new_len;
+    grown->text[new_len] = '\0';
+    if (grown != s) str_unref(s); /* Only now: text may point into s */
+    *v = box(grown);
+}
+
+/* An integer value. One that fits in 48 bits is the payload itself; a
+   larger one is boxed in a temporary String holding its 8 bytes. */
+Value int_make(int64_t i) {
+    Value v;
+    if (i >= -((int64_t)1 << 47) && i < ((int64_t)1 << 47)) {
+        v.bits = NAN_BOX_INT | ((uint64_t)i & NAN_BOX_PTR);
+    } else {
+        String *s = temp_string(sizeof i);
+        memcpy(s->text, &i, sizeof i);
+        v.bits = NAN_BOX_BIG | (uint64_t)(uintptr_t)s;
+    }
+    return v;
+}
+
+int64_t int_of(Value v) {
+    int64_t i;
+    if ((v.bits & ~NAN_BOX_PTR) == NAN_BOX_BIG) {
+        memcpy(&i, unbox(&v)->text, sizeof i);
+        return i;
+    }
+    i = (int64_t)(v.bits & NAN_BOX_PTR);
+    return (i & ((int64_t)1 << 47)) ? i - ((int64_t)1 << 48) : i;
+}
+
+/* Replace the stored value *v with the integer i */
+void int_store(Value *v, int64_t i) {
+    Value n = keep_value(int_make(i));
+    drop_value(*v);
+    *v = n;
+}
+
+/* Whether v points to a String: a string or a boxed integer */
+static int has_string(Value v) {
+    uint64_t tag = v.bits & ~NAN_BOX_PTR;
+    return tag == NAN_BOX_STR || tag == NAN_BOX_BIG;
+}
+
+/* A temporary in the form it is stored in a variable: holding its own
+   reference to its string, which is copied if it is in the arena */
+Value keep_value(Value v) {
+    String *s;
+    if (!has_string(v)) return v;
+    s = unbox(&v);
+    if (s->refs == 0) {
+        v.bits = (v.bits & ~NAN_BOX_PTR) | (uint64_t)(uintptr_t)str_new(s->text, s->len);
+        return v;
+    }
+    str_ref(s);
+    return v;
+}
+
+/* Give back the string a stored value holds, if any */
+void drop_value(Value v) {
+    if (has_string(v)) str_unref(unbox(&v));
+}
+
+#endif
+
+/* atof() of a string value, whose text need not be NUL-terminated */
+double str_to_num(const Value *v) {
+    return parse_number(str_data(v), str_len(v));
+}
+
+/* atof() of the len characters at text, which need not be followed by a
+   NUL: INPUT # reads numbers straight out of a file's buffer. A plain
+   decimal with at most 15 significant digits and a power of ten of at
+   most 22 either way is one multiplication or division of two exact
+   doubles, so it is rounded correctly; anything else goes to atof().
+   atof() turns "NAN(...)" into a NaN with whatever payload the text asks
+   for, which could pass for a string in the NaN-boxed layout, so any NaN
+   is replaced by the default one, keeping only its sign. */
+double parse_number(const char *text, size_t len) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = text, *end = text + len;
+    int64_t mantissa = 0;
+    double x;
+    int neg = 0, any = 0, significant = 0, scale = 0;
+    char buf[64];
+    char *copy = buf;
+
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        any = 1;
+        if (mantissa == 0 && *p == '0') continue;
+        mantissa = mantissa * 10 + (*p - '0');
+        if (++significant > 15) goto slow;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            any = 1;
+            scale--;
+            if (mantissa == 0 && *p == '0') continue;
+            mantissa = mantissa * 10 + (*p - '0');
+            if (++significant > 15) goto slow;
+        }
+    }
+    if (!any) goto slow;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int exp_neg = 0, exp = 0;
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) exp_neg = (*p++ == '-');
+        if (p == end) goto slow;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (exp < 1000) exp = exp * 10 + (*p - '0');
+        }
+        scale += exp_neg ? -exp : exp;
+    }
+    if (p == end && scale >= -22 && scale <= 22) {
+        x = (double)mantissa;
+        x = (scale < 0) ? x / powers[-scale] : x * powers[scale];
+        return neg ? -x : x;
+    }
+
+slow:
+    if (len >= sizeof(buf)) copy = temp_alloc(len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    x = atof(copy);
+    return (x != x) ? copysign(NAN, x) : x;
+}
+
+/* strcmp() ordering, but by length rather than up to the first NUL */
+int str_compare(const Value *a, const Value *b) {
+    size_t alen = str_len(a), blen = str_len(b);
+    int cmp = memcmp(str_data(a), str_data(b), alen < blen ? alen : blen);
+    if (cmp != 0) return cmp;
+    return (alen > blen) - (alen < blen);
+}
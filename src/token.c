@@ -1,4 +1,6 @@
 #include "bas.h"
+#include <errno.h>
+#include <time.h>
 
 typedef struct {
     char *name;
@@ -39,6 +41,8 @@ static Keyword keywords[] = {
     {"INT", TOK_INT},
     {"ABS", TOK_ABS},
     {"SGN", TOK_SGN},
+    {"EOF", TOK_EOF_FN},
+    {"LOF", TOK_LOF},
     {"RND", TOK_RND},
     {"TAB", TOK_TAB},
     {"SPC", TOK_SPC},
@@ -63,103 +67,360 @@ static Keyword keywords[] = {
     {"OR", TOK_OR},
     {"NOT", TOK_NOT},
     {"ON", TOK_ON},
+    {"USING", TOK_USING},
+    {"OPEN", TOK_OPEN},
+    {"CLOSE", TOK_CLOSE},
+    {"AS", TOK_AS},
+    {"OUTPUT", TOK_OUTPUT},
+    {"APPEND", TOK_APPEND},
+    {"LINE", TOK_LINE},
+    {"MAPPED", TOK_MAPPED},
     {"FILES", TOK_FILES},
     {"CHDIR", TOK_CHDIR},
     {NULL, TOK_NONE}
 };
 
-void init_tokenizer(char *line) {
-    token_ptr = line;
-    next_token();
+/*
+ * Keyword index: keywords bucketed by first letter and length, built from
+ * keywords[] on first use, so adding an entry to the table is all it takes.
+ * A lookup inspects only the (usually one or two) keywords in its bucket.
+ */
+#define MAX_KEYWORD_LEN 8
+static short kw_first[26][MAX_KEYWORD_LEN + 1];
+static short kw_next[sizeof(keywords) / sizeof(keywords[0])];
+static int kw_index_built = 0;
+static int kw_linear = 0; /* Benchmark only: use the plain table scan */
+
+static void build_keyword_index(void) {
+    int i;
+    memset(kw_first, -1, sizeof(kw_first));
+    /* Walk backwards so each bucket chain keeps table order */
+    for (i = (int)(sizeof(keywords) / sizeof(keywords[0])) - 2; i >= 0; i--) {
+        size_t len = strlen(keywords[i].name);
+        int letter = keywords[i].name[0] - 'A';
+        if (len > MAX_KEYWORD_LEN || letter < 0 || letter >= 26) {
+            fprintf(stderr, "Keyword %s cannot be indexed\n", keywords[i].name);
+            exit(1);
+        }
+        kw_next[i] = kw_first[letter][len];
+        kw_first[letter][len] = (short)i;
+    }
+    kw_index_built = 1;
 }
 
-void next_token(void) {
-    char *start;
+/* Token type for an upper-cased word, or TOK_IDENTIFIER if it is not a keyword */
+static BasTokenType lookup_keyword(const char *word, int len) {
     int i;
-    
-    while (*token_ptr && isspace(*token_ptr)) token_ptr++;
-
-    if (*token_ptr == '\0') {
-        current_token = TOK_EOL;
-        return;
-    }
-
-    if (isdigit(*token_ptr) || *token_ptr == '.') {
-        current_token = TOK_NUMBER;
-        token_number = strtod(token_ptr, &token_ptr);
-        return;
-    }
-
-    if (*token_ptr == '"') {
-        current_token = TOK_STRING;
-        token_ptr++;
-        start = token_ptr;
-        while (*token_ptr && *token_ptr != '"') token_ptr++;
-        if (*token_ptr == '"') {
-            *token_ptr = '\0';
-            strcpy(token_string, start);
-            *token_ptr = '"'; /* Restore for safety? No need if we copy */
-            token_ptr++;
-        } else {
-            error("Unterminated string");
+
+    if (kw_linear) {
+        for (i = 0; keywords[i].name != NULL; i++) {
+            if (strcmp(word, keywords[i].name) == 0) return keywords[i].type;
+        }
+        return TOK_IDENTIFIER;
+    }
+
+    if (len > MAX_KEYWORD_LEN) return TOK_IDENTIFIER;
+    if (!kw_index_built) build_keyword_index();
+    for (i = kw_first[word[0] - 'A'][len]; i >= 0; i = kw_next[i]) {
+        if (memcmp(word, keywords[i].name, len) == 0) return keywords[i].type;
+    }
+    return TOK_IDENTIFIER;
+}
+
+/* Interned identifier names. Every occurrence of a name in any crunched line
+   points at the same string, so later stages can compare names by pointer. */
+static char **intern_table = NULL;
+static size_t intern_cap = 0;
+static size_t intern_count = 0;
+
+/* FNV-1a. Computed once per identifier while crunching and carried in the
+   token, so the symbol table never has to hash a name at run time. */
+static unsigned hash_name(const char *name) {
+    unsigned h = 2166136261U;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static const char *intern_name(const char *name, unsigned hash) {
+    size_t i;
+    char *copy;
+
+    if (intern_count * 2 >= intern_cap) {
+        size_t new_cap = intern_cap ? intern_cap * 2 : 256;
+        char **new_table = calloc(new_cap, sizeof(char *));
+        if (!new_table) error("Out of memory");
+        for (i = 0; i < intern_cap; i++) {
+            if (intern_table[i]) {
+                size_t j = hash_name(intern_table[i]) & (new_cap - 1);
+                while (new_table[j]) j = (j + 1) & (new_cap - 1);
+                new_table[j] = intern_table[i];
+            }
+        }
+        free(intern_table);
+        intern_table = new_table;
+        intern_cap = new_cap;
+    }
+
+    i = hash & (intern_cap - 1);
+    while (intern_table[i]) {
+        if (strcmp(intern_table[i], name) == 0) return intern_table[i];
+        i = (i + 1) & (intern_cap - 1);
+    }
+    copy = malloc(strlen(name) + 1);
+    if (!copy) error("Out of memory");
+    strcpy(copy, name);
+    intern_table[i] = copy;
+    intern_count++;
+    return copy;
+}
+
+/* Scratch space used while crunching a line; the result is copied into a
+   single exact-sized block so a line's tokens can be freed with one free(). */
+static Token *scratch_tokens = NULL;
+static size_t *scratch_offsets = NULL; /* Pool offset of each token's string, or -1 */
+static size_t scratch_token_cap = 0;
+static char *scratch_pool = NULL;
+static size_t scratch_pool_cap = 0;
+
+/* Append len characters of text and a NUL to the scratch pool, which is
+   filled up to *pool_len; returns their offset */
+static long pool_append(const char *text, size_t len, size_t *pool_len) {
+    size_t offset = *pool_len;
+    if (offset + len + 1 > scratch_pool_cap) {
+        size_t new_cap = scratch_pool_cap ? scratch_pool_cap : 256;
+        while (offset + len + 1 > new_cap) new_cap *= 2;
+        scratch_pool = realloc(scratch_pool, new_cap);
+        if (!scratch_pool) error("Out of memory");
+        scratch_pool_cap = new_cap;
+    }
+    memcpy(scratch_pool + offset, text, len);
+    scratch_pool[offset + len] = '\0';
+    *pool_len = offset + len + 1;
+    return (long)offset;
+}
+
+/* Scan one token from *p into tok. String literals, and identifiers when
+   intern is 0, are appended to the scratch pool at *pool_len; their offset
+   is returned (or -1 if none). */
+static long lex_token(const char **p, Token *tok, size_t *pool_len, int intern) {
+    const char *s = *p;
+    const char *start;
+
+    tok->num = 0.0;
+    tok->str = NULL;
+    tok->hash = 0;
+    tok->is_int = 0;
+    tok->ival = 0;
+    tok->code = NULL;
+    tok->plan = NULL;
+    tok->fn = -1;
+    tok->slot = -1;
+    tok->target_gen = 0;
+
+    while (*s && isspace((unsigned char)*s)) s++;
+
+    if (*s == '\0') {
+        tok->type = TOK_EOL;
+        *p = s;
+        return -1;
+    }
+
+    if (isdigit((unsigned char)*s) || *s == '.') {
+        char *end;
+        tok->type = TOK_NUMBER;
+        tok->num = strtod(s, &end);
+        if (end == s) end++; /* A lone '.' reads as 0 */
+        /* Only digits: an integer literal, if it fits */
+        start = s;
+        while (start < end && isdigit((unsigned char)*start)) start++;
+        if (start == end) {
+            long long n;
+            errno = 0;
+            n = strtoll(s, NULL, 10);
+            if (errno != ERANGE) {
+                tok->is_int = 1;
+                tok->ival = n;
+            }
+        }
+        *p = end;
+        return -1;
+    }
+
+    if (*s == '"') {
+        s++;
+        start = s;
+        while (*s && *s != '"') s++;
+        if (*s != '"') {
+            tok->type = TOK_ERROR;
+            tok->str = "Unterminated string";
+            *p = s;
+            return -1;
         }
-        return;
+        tok->type = TOK_STRING;
+        *p = s + 1;
+        return pool_append(start, s - start, pool_len);
     }
 
-    if (isalpha(*token_ptr)) {
+    if (isalpha((unsigned char)*s)) {
         /* Identifier or Keyword */
         char buffer[MAX_VAR_NAME];
         int len = 0;
-        
+
         /* Allow alphanumeric and '$' */
-        while ((isalnum(*token_ptr) || *token_ptr == '$') && len < MAX_VAR_NAME - 1) {
-            buffer[len++] = toupper(*token_ptr);
-            token_ptr++;
+        while ((isalnum((unsigned char)*s) || *s == '$') && len < MAX_VAR_NAME - 1) {
+            buffer[len++] = toupper((unsigned char)*s);
+            s++;
+        }
+        /* A '%' straight after the name makes it an integer variable (A%),
+           a '!' single precision (A!). Anywhere else '%' is the MOD operator. */
+        if ((*s == '%' || *s == '!') && len < MAX_VAR_NAME - 1) {
+            buffer[len++] = *s;
+            s++;
         }
         buffer[len] = '\0';
+        *p = s;
 
         /* Check keywords */
-        for (i = 0; keywords[i].name != NULL; i++) {
-            if (strcmp(buffer, keywords[i].name) == 0) {
-                current_token = keywords[i].type;
-                return;
-            }
-        }
+        tok->type = lookup_keyword(buffer, len);
 
         /* Not a keyword, must be identifier */
-        current_token = TOK_IDENTIFIER;
-        strcpy(token_string, buffer);
-        return;
+        if (tok->type == TOK_IDENTIFIER) {
+            if (!intern) return pool_append(buffer, len, pool_len);
+            tok->hash = hash_name(buffer);
+            tok->str = intern_name(buffer, tok->hash);
+            if (len == 3 && buffer[0] == 'F' && buffer[1] == 'N' && isupper((unsigned char)buffer[2])) {
+                tok->fn = (signed char)(buffer[2] - 'A');
+            }
+        }
+        return -1;
     }
 
     /* Operators and Punctuation */
-    switch (*token_ptr) {
-        case '+': current_token = TOK_PLUS; token_ptr++; break;
-        case '-': current_token = TOK_MINUS; token_ptr++; break;
-        case '*': current_token = TOK_MUL; token_ptr++; break;
-        case '/': current_token = TOK_DIV; token_ptr++; break;
-        case '%': current_token = TOK_MOD; token_ptr++; break;
-        case '(': current_token = TOK_LPAREN; token_ptr++; break;
-        case ')': current_token = TOK_RPAREN; token_ptr++; break;
-        case ',': current_token = TOK_COMMA; token_ptr++; break;
-        case ';': current_token = TOK_SEMICOLON; token_ptr++; break;
-        case ':': current_token = TOK_COLON; token_ptr++; break;
-        case '=': current_token = TOK_EQ; token_ptr++; break;
+    switch (*s) {
+        case '+': tok->type = TOK_PLUS; s++; break;
+        case '-': tok->type = TOK_MINUS; s++; break;
+        case '*': tok->type = TOK_MUL; s++; break;
+        case '/': tok->type = TOK_DIV; s++; break;
+        case '%': tok->type = TOK_MOD; s++; break;
+        case '(': tok->type = TOK_LPAREN; s++; break;
+        case ')': tok->type = TOK_RPAREN; s++; break;
+        case ',': tok->type = TOK_COMMA; s++; break;
+        case ';': tok->type = TOK_SEMICOLON; s++; break;
+        case ':': tok->type = TOK_COLON; s++; break;
+        case '#': tok->type = TOK_HASH; s++; break;
+        case '=': tok->type = TOK_EQ; s++; break;
         case '<':
-            token_ptr++;
-            if (*token_ptr == '>') { current_token = TOK_NE; token_ptr++; }
-            else if (*token_ptr == '=') { current_token = TOK_LE; token_ptr++; }
-            else current_token = TOK_LT;
+            s++;
+            if (*s == '>') { tok->type = TOK_NE; s++; }
+            else if (*s == '=') { tok->type = TOK_LE; s++; }
+            else tok->type = TOK_LT;
             break;
         case '>':
-            token_ptr++;
-            if (*token_ptr == '=') { current_token = TOK_GE; token_ptr++; }
-            else current_token = TOK_GT;
+            s++;
+            if (*s == '=') { tok->type = TOK_GE; s++; }
+            else tok->type = TOK_GT;
             break;
         default:
-            error("Unknown character");
+            tok->type = TOK_ERROR;
+            tok->str = "Unknown character";
             break;
     }
+    *p = s;
+    return -1;
+}
+
+static Token *crunch(const char *text, int intern) {
+    size_t count = 0;
+    size_t pool_len = 0;
+    size_t i;
+    Token *block;
+    char *pool;
+
+    while (1) {
+        long offset;
+        BasTokenType type;
+
+        if (count >= scratch_token_cap) {
+            size_t new_cap = scratch_token_cap ? scratch_token_cap * 2 : 64;
+            scratch_tokens = realloc(scratch_tokens, new_cap * sizeof(Token));
+            scratch_offsets = realloc(scratch_offsets, new_cap * sizeof(size_t));
+            if (!scratch_tokens || !scratch_offsets) error("Out of memory");
+            scratch_token_cap = new_cap;
+        }
+
+        offset = lex_token(&text, &scratch_tokens[count], &pool_len, intern);
+        scratch_offsets[count] = (offset < 0) ? (size_t)-1 : (size_t)offset;
+        type = scratch_tokens[count].type;
+        count++;
+
+        if (type == TOK_EOL) break;
+        /* Errors surface when execution reaches them; REM swallows the rest of the line */
+        if (type == TOK_ERROR || type == TOK_REM) {
+            text = "";
+        }
+    }
+
+    block = malloc(count * sizeof(Token) + pool_len);
+    if (!block) error("Out of memory");
+    memcpy(block, scratch_tokens, count * sizeof(Token));
+    pool = (char *)(block + count);
+    if (pool_len) memcpy(pool, scratch_pool, pool_len);
+    for (i = 0; i < count; i++) {
+        if (scratch_offsets[i] != (size_t)-1) block[i].str = pool + scratch_offsets[i];
+    }
+    return block;
+}
+
+Token *crunch_line(const char *text) {
+    return crunch(text, 1);
+}
+
+/* Crunch a line typed in answer to INPUT. Its words are kept in the line's
+   own block instead of being interned, so a program reading free text does
+   not fill the intern table with names that are never freed. */
+Token *crunch_input(const char *text) {
+    return crunch(text, 0);
+}
+
+/* Free a crunched line. A DEF FN whose body lies in it is forgotten, since
+   the function keeps a pointer to its first token. */
+void free_tokens(Token *tokens) {
+    Token *t;
+    int i;
+    if (!tokens) return;
+    for (t = tokens; ; t++) {
+        if (t->code) vm_free_code(t->code);
+        if (t->plan) using_free(t->plan);
+        for (i = 0; i < 26; i++) {
+            if (user_functions[i].expr == t) {
+                user_functions[i].expr = NULL;
+                user_functions[i].defined = 0;
+            }
+        }
+        if (t->type == TOK_EOL) break;
+    }
+    free(tokens);
+}
+
+void init_tokenizer(Token *tokens) {
+    token_ptr = tokens;
+    next_token();
+}
+
+void next_token(void) {
+    Token *tok = token_ptr;
+
+    current_token = tok->type;
+    token_number = tok->num;
+    token_string = tok->str;
+    token_cur = tok;
+
+    if (current_token == TOK_EOL) return; /* Stay on the end of line */
+    if (current_token == TOK_ERROR) error(tok->str);
+    token_ptr++;
 }
 
 int match(BasTokenType t) {
@@ -169,3 +430,59 @@ int match(BasTokenType t) {
     }
     return 0;
 }
+
+/* Micro-benchmark: crunch every line of the given files repeatedly, once with
+   the keyword index and once with the linear table scan (--bench-lex). */
+void bench_lexer(int nfiles, char **files) {
+    char **lines = NULL;
+    size_t nlines = 0, cap = 0, tokens = 0, i;
+    char *buffer = NULL;
+    size_t buffer_cap = 0;
+    int f, pass, mode;
+    const int passes = 50;
+
+    for (f = 0; f < nfiles; f++) {
+        FILE *fp = fopen(files[f], "r");
+        if (!fp) {
+            fprintf(stderr, "Could not open file %s\n", files[f]);
+            continue;
+        }
+        while (read_line(fp, &buffer, &buffer_cap)) {
+            if (nlines >= cap) {
+                cap = cap ? cap * 2 : 1024;
+                lines = realloc(lines, cap * sizeof(char *));
+                if (!lines) error("Out of memory");
+            }
+            lines[nlines] = malloc(strlen(buffer) + 1);
+            strcpy(lines[nlines++], buffer);
+        }
+        fclose(fp);
+    }
+
+    for (i = 0; i < nlines; i++) {
+        Token *t = crunch_line(lines[i]);
+        Token *p = t;
+        while (p->type != TOK_EOL && p->type != TOK_ERROR) { p++; tokens++; }
+        free_tokens(t);
+    }
+    printf("%d files, %lu lines, %lu tokens, %d passes\n",
+           nfiles, (unsigned long)nlines, (unsigned long)tokens, passes);
+
+    for (mode = 0; mode < 2; mode++) {
+        clock_t start;
+        double secs;
+        kw_linear = mode;
+        start = clock();
+        for (pass = 0; pass < passes; pass++) {
+            for (i = 0; i < nlines; i++) free_tokens(crunch_line(lines[i]));
+        }
+        secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        printf("%-18s %8.1f ns/token\n", mode ? "linear keywords:" : "indexed keywords:",
+               secs * 1e9 / ((double)tokens * passes));
+    }
+    kw_linear = 0;
+
+    for (i = 0; i < nlines; i++) free(lines[i]);
+    free(lines);
+    free(buffer);
+}
@@ -1,165 +1,301 @@
 #include "bas.h"
 
-Value get_var(const char *name) {
+/* Scalar variables live in 'variables' in creation order; var_index is an
+   open-addressing table of positions into it, keyed by the name hash the
+   lexer stored in the token. Both grow by doubling, so there is no limit on
+   the number of variables.
+
+   A variable's position is its slot. Slots are never given back: RUN and
+   NEW only reset the values, so a slot cached in a token stays valid for
+   as long as the interpreter runs. */
+static int var_cap = 0;
+static int *var_index = NULL; /* -1 marks an empty slot */
+static int var_index_cap = 0;
+
+static void rebuild_var_index(int new_cap) {
+    int *table = malloc(new_cap * sizeof(int));
     int i;
+    if (!table) error("Out of memory");
+    for (i = 0; i < new_cap; i++) table[i] = -1;
     for (i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            /* Duplicate string if it is one, to avoid double free issues if caller frees it? 
-               Usually caller reads. But we are returning by value. 
-               The 'str' pointer in Value points to heap. 
-               We should probably return a COPY of the string if we want to be safe, 
-               or assume the variable owns the string and we return a reference (dangerous if var changes).
-               For simplicity in this toy interpreter: return COPY. 
-            */
-            Value v = variables[i].val;
-            if (v.type == VAL_STR && v.str) {
-                /* We must return a new copy because expressions might free it?
-                   Actually, if we return the same pointer, and the user does 'A$ = A$ + "x"', 
-                   the expression evaluator might free the old A$ string?
-                   Let's stick to rule: Values in variables own their strings.
-                   Values returned by expressions own their strings (temporaries).
-                   So get_var should return a copy.
-                */
-                char *copy = malloc(strlen(v.str) + 1);
-                strcpy(copy, v.str);
-                v.str = copy;
-            }
-            return v;
-        }
+        int j = variables[i].hash & (new_cap - 1);
+        while (table[j] >= 0) j = (j + 1) & (new_cap - 1);
+        table[j] = i;
     }
-    
-    /* Default value */
-    {
-        Value v;
-        if (strchr(name, '$')) {
-            v.type = VAL_STR;
-            v.str = malloc(1);
-            *v.str = '\0';
-        } else {
-            v.type = VAL_NUM;
-            v.num = 0.0;
+    free(var_index);
+    var_index = table;
+    var_index_cap = new_cap;
+}
+
+/* The type a variable or array name declares by its suffix */
+static ValType name_type(const char *name) {
+    if (strchr(name, '$')) return VAL_STR;
+    if (strchr(name, '%')) return VAL_INT;
+    if (strchr(name, '!')) return VAL_SNG;
+    return VAL_NUM;
+}
+
+/* Slot of the variable 'name', created with its default value if needed */
+static int var_slot(const char *name, unsigned hash) {
+    int i;
+    if (var_count > 0) {
+        i = hash & (var_index_cap - 1);
+        while (var_index[i] >= 0) {
+            Variable *v = &variables[var_index[i]];
+            if (v->hash == hash && strcmp(v->name, name) == 0) return var_index[i];
+            i = (i + 1) & (var_index_cap - 1);
         }
-        return v;
     }
+
+    if (var_count == var_cap) {
+        int new_cap = var_cap ? var_cap * 2 : 64;
+        Variable *grown = realloc(variables, new_cap * sizeof(Variable));
+        if (!grown) error("Out of memory");
+        variables = grown;
+        var_cap = new_cap;
+    }
+    if ((var_count + 1) * 2 > var_index_cap) {
+        rebuild_var_index(var_index_cap ? var_index_cap * 2 : 128);
+    }
+    strcpy(variables[var_count].name, name);
+    variables[var_count].hash = hash;
+    variables[var_count].type = name_type(name);
+    if (variables[var_count].type == VAL_STR) {
+        variables[var_count].val = keep_value(str_make("", 0)); /* Reads as "" */
+    } else if (variables[var_count].type == VAL_INT) {
+        SET_INT(variables[var_count].val, 0);
+    } else {
+        SET_NUM(variables[var_count].val, 0.0);
+    }
+    i = hash & (var_index_cap - 1);
+    while (var_index[i] >= 0) i = (i + 1) & (var_index_cap - 1);
+    var_index[i] = var_count;
+    return var_count++;
 }
 
-void set_var(const char *name, Value val) {
-    int i;
-    
+/* Bind an identifier token to its variable slot, once */
+int resolve_var(Token *tok) {
+    if (tok->slot < 0) tok->slot = var_slot(tok->str, tok->hash);
+    return tok->slot;
+}
+
+Value get_var(int slot) {
+    /* The copy borrows the variable's string for the rest of the statement */
+    return variables[slot].val;
+}
+
+void set_var(int slot, Value val) {
+    Variable *var = &variables[slot];
+
     /* Check type match */
-    int is_str_var = (strchr(name, '$') != NULL);
-    if (is_str_var && val.type != VAL_STR) {
+    if (var->type == VAL_STR && VAL_TYPE(val) != VAL_STR) {
         error("Type mismatch: Expected string");
     }
-    if (!is_str_var && val.type != VAL_NUM) {
+    if (var->type != VAL_STR && VAL_TYPE(val) == VAL_STR) {
         error("Type mismatch: Expected number");
     }
 
-    for (i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            /* Free old string if exists */
-            if (variables[i].val.type == VAL_STR && variables[i].val.str) {
-                free(variables[i].val.str);
-            }
-            variables[i].val = val;
-            return;
+    /* Numbers take the type of the variable */
+    if (var->type == VAL_INT) {
+        if (VAL_TYPE(val) != VAL_INT) {
+            int64_t i = int_value(val);
+            SET_INT(val, i);
         }
+    } else if (var->type == VAL_SNG) {
+        SET_NUM(var->val, (float)NUM_OF(val));
+        return;
+    } else if (VAL_TYPE(val) == VAL_INT) {
+        SET_NUM(val, (double)INT_OF(val));
     }
-    if (var_count < 100) {
-        strcpy(variables[var_count].name, name);
-        variables[var_count].val = val;
-        var_count++;
-    } else {
-        error("Too many variables");
+
+    /* Keep the new value before releasing the old one, which may be the
+       same: a string, or in the NaN-boxed layout a large integer */
+    val = keep_value(val);
+    drop_value(var->val);
+    var->val = val;
+}
+
+/* Assign var + val to a string variable (A$ = A$ + X$), extending its
+   string in place rather than building a new one */
+void append_var(int slot, Value val) {
+    Variable *var = &variables[slot];
+
+    if (VAL_TYPE(val) != VAL_STR) {
+        apply_binary(TOK_PLUS, get_var(slot), val); /* Reports the mismatch */
     }
+    str_append(&var->val, str_data(&val), str_len(&val));
 }
 
-void create_array(const char *name, int dims, int *sizes) {
+/* Reset every variable to its default value (RUN, NEW, LOAD) */
+void clear_variables(void) {
     int i;
-    for (i = 0; i < array_count; i++) {
-        if (strcmp(arrays[i].name, name) == 0) {
-            error("Array already defined");
+    for (i = 0; i < var_count; i++) {
+        if (variables[i].type == VAL_STR) {
+            drop_value(variables[i].val);
+            variables[i].val = keep_value(str_make("", 0));
+        } else if (variables[i].type == VAL_INT) {
+            STORE_INT(variables[i].val, 0);
+        } else {
+            SET_NUM(variables[i].val, 0.0);
         }
     }
-    
-    if (array_count < MAX_ARRAYS) {
-        int total_size = 1;
-        int d;
-        
-        arrays[array_count].dims = dims;
-        for (d = 0; d < dims; d++) {
-            arrays[array_count].dim_sizes[d] = sizes[d];
-            total_size *= sizes[d];
+}
+
+static int array_cap = INIT_ARRAYS;
+
+/* Bind a subscripted identifier token to its array slot, once */
+int resolve_array(Token *tok) {
+    int i;
+    if (tok->slot >= 0) return tok->slot;
+
+    for (i = 0; i < array_count; i++) {
+        if (arrays[i].hash == tok->hash && strcmp(arrays[i].name, tok->str) == 0) {
+            return tok->slot = i;
         }
-        arrays[array_count].total_size = total_size;
-        
-        arrays[array_count].data = (Value *)calloc(total_size, sizeof(Value));
-        if (!arrays[array_count].data) error("Out of memory for array");
-        
-        strcpy(arrays[array_count].name, name);
-        
-        if (strchr(name, '$')) {
-             arrays[array_count].type = VAL_STR;
-             int j;
-             for(j=0; j<total_size; j++) {
-                 arrays[array_count].data[j].type = VAL_STR;
-                 arrays[array_count].data[j].str = malloc(1);
-                 arrays[array_count].data[j].str[0] = '\0';
-             }
-        } else {
-             arrays[array_count].type = VAL_NUM;
+    }
+    if (array_count == array_cap) {
+        arrays = grow_storage(arrays, &array_cap, INIT_ARRAYS, sizeof(Array));
+    }
+
+    memset(&arrays[array_count], 0, sizeof(Array));
+    strcpy(arrays[array_count].name, tok->str);
+    arrays[array_count].hash = tok->hash;
+    arrays[array_count].type = name_type(tok->str);
+    return tok->slot = array_count++;
+}
+
+void create_array(int slot, int dims, int *sizes) {
+    Array *arr = &arrays[slot];
+    int total_size = 1;
+    int d;
+
+    if (arr->dim_sizes) {
+        error("Array already defined");
+    }
+
+    for (d = 0; d < dims; d++) {
+        if (sizes[d] < 0 || (sizes[d] > 0 && total_size > INT_MAX / sizes[d])) {
+            error("Out of memory for array");
         }
-        
-        array_count++;
+        total_size *= sizes[d];
+    }
+
+    /* Numeric arrays are packed doubles (int64_t for A%, float for A!),
+       string arrays packed pointers. String elements start out NULL, which
+       reads as "", so DIM allocates nothing per element. */
+    if (arr->type == VAL_STR) {
+        arr->strs = calloc(total_size ? total_size : 1, sizeof(String *));
+    } else if (arr->type == VAL_INT) {
+        arr->ints = calloc(total_size ? total_size : 1, sizeof(int64_t));
+    } else if (arr->type == VAL_SNG) {
+        arr->sngs = calloc(total_size ? total_size : 1, sizeof(float));
     } else {
-        error("Too many arrays");
+        arr->nums = calloc(total_size ? total_size : 1, sizeof(double));
+    }
+    arr->dim_sizes = malloc(dims * sizeof(int));
+    if (!(arr->strs || arr->nums || arr->ints || arr->sngs) || !arr->dim_sizes) {
+        free(arr->strs);
+        free(arr->nums);
+        free(arr->ints);
+        free(arr->sngs);
+        free(arr->dim_sizes);
+        arr->strs = NULL;
+        arr->nums = NULL;
+        arr->ints = NULL;
+        arr->sngs = NULL;
+        arr->dim_sizes = NULL;
+        error("Out of memory for array");
     }
+    arr->dims = dims;
+    memcpy(arr->dim_sizes, sizes, dims * sizeof(int));
+    arr->total_size = total_size;
+    arr->strs_set = 0;
 }
 
-Value *get_array_ptr(const char *name, int dims, int *indices) {
+/* Free the contents of every array (RUN, NEW, LOAD); the slots remain */
+void clear_arrays(void) {
     int i;
     for (i = 0; i < array_count; i++) {
-        if (strcmp(arrays[i].name, name) == 0) {
-            if (arrays[i].dims != dims) {
-                error("Incorrect number of subscripts");
-            }
-            
-            int offset = 0;
-            int d;
-            for (d = 0; d < dims; d++) {
-                if (indices[d] < 0 || indices[d] >= arrays[i].dim_sizes[d]) {
-                    error("Array index out of bounds");
+        Array *arr = &arrays[i];
+        if (!arr->dim_sizes) continue;
+        if (arr->type == VAL_STR) {
+            /* Stop once every string that was assigned has been released */
+            int j;
+            for (j = 0; arr->strs_set > 0; j++) {
+                if (arr->strs[j]) {
+                    str_unref(arr->strs[j]);
+                    arr->strs_set--;
                 }
-                /* Stride calculation:
-                   For 2D: [x][y] -> x * size_y + y
-                   For 3D: [x][y][z] -> (x * size_y + y) * size_z + z
-                   General: offset = offset * next_dim_size + next_index
-                   Wait, "next_dim_size" isn't correct in loop order.
-                   Common C way: offset = offset * dim_size[d] + indices[d] ?
-                   No. 
-                   dim_sizes[0] = X_SIZE, dim_sizes[1] = Y_SIZE.
-                   A[i][j].
-                   Offset = i * Y_SIZE + j.
-                   
-                   Generalized:
-                   offset = 0
-                   for d = 0 to dims-1:
-                       offset = offset * (dim_sizes[d]???) + indices[d]
-                       
-                   No, stride for dimension d is product of sizes[d+1...end].
-                   
-                   Let's use the iterative approach:
-                   offset = indices[0]
-                   for d = 1 to dims-1:
-                       offset = offset * arrays[i].dim_sizes[d] + indices[d]
-                */
-                if (d == 0) offset = indices[d];
-                else offset = offset * arrays[i].dim_sizes[d] + indices[d];
             }
-            
-            return &arrays[i].data[offset];
         }
+        free(arr->strs);
+        free(arr->nums);
+        free(arr->ints);
+        free(arr->sngs);
+        free(arr->dim_sizes);
+        arr->strs = NULL;
+        arr->nums = NULL;
+        arr->ints = NULL;
+        arr->sngs = NULL;
+        arr->dim_sizes = NULL;
+    }
+}
+
+/* Element offset of arr(indices), checking the subscripts */
+static int array_offset(Array *arr, int dims, int *indices) {
+    int offset = 0;
+    int d;
+
+    if (!arr->dim_sizes) {
+        error("Array not defined");
+    }
+    if (arr->dims != dims) {
+        error("Incorrect number of subscripts");
+    }
+
+    for (d = 0; d < dims; d++) {
+        if (indices[d] < 0 || indices[d] >= arr->dim_sizes[d]) {
+            error("Array index out of bounds");
+        }
+        /* Row-major: the stride of dimension d is the product of the
+           sizes of the dimensions after it, so
+           offset = (i0 * size1 + i1) * size2 + i2 ... */
+        if (d == 0) offset = indices[d];
+        else offset = offset * arr->dim_sizes[d] + indices[d];
     }
-    error("Array not defined");
-    return NULL; 
+    return offset;
+}
+
+/* Element of a numeric array */
+double *array_num_ptr(int slot, int dims, int *indices) {
+    Array *arr = &arrays[slot];
+    return &arr->nums[array_offset(arr, dims, indices)];
+}
+
+/* Element of an integer array */
+int64_t *array_int_ptr(int slot, int dims, int *indices) {
+    Array *arr = &arrays[slot];
+    return &arr->ints[array_offset(arr, dims, indices)];
+}
+
+/* Element of a single-precision array */
+float *array_sng_ptr(int slot, int dims, int *indices) {
+    Array *arr = &arrays[slot];
+    return &arr->sngs[array_offset(arr, dims, indices)];
+}
+
+/* Element of a string array, NULL if it has never been assigned. The cell
+   keeps its reference; take another to hold on to the string. */
+String *array_str_get(int slot, int dims, int *indices) {
+    Array *arr = &arrays[slot];
+    return arr->strs[array_offset(arr, dims, indices)];
+}
+
+/* Replace a string element, taking over the reference to str */
+void array_str_set(int slot, int dims, int *indices, String *str) {
+    Array *arr = &arrays[slot];
+    String **cell = &arr->strs[array_offset(arr, dims, indices)];
+    arr->strs_set += (str != NULL) - (*cell != NULL);
+    str_unref(*cell);
+    *cell = str;
 }
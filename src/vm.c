@@ -0,0 +1,531 @@
+#include "bas.h"
+
+/*
+ * Bytecode compiler and stack VM for expressions.
+ *
+ * The first time an expression is evaluated, the tokens from its first token
+ * onwards are compiled into a VmCode that is cached on that token. Every later
+ * evaluation runs the bytecode and moves the token stream straight past the
+ * expression, so the recursive-descent parse happens once per site instead of
+ * once per execution. Operator semantics live in eval.c and are shared with
+ * the tree-walking evaluator, which remains available with --tree.
+ */
+
+#if defined(__GNUC__) && !defined(BAS_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+#define VM_INLINE_STACK 32
+
+/* Keep in sync with the dispatch table in vm_run() */
+typedef enum {
+    OP_NUM, OP_INT, OP_STR, OP_VAR, OP_ELEM, OP_CALL,
+    OP_NEG, OP_NOT,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+    OP_EQ, OP_NE, OP_LT, OP_GT, OP_LE, OP_GE,
+    OP_AND, OP_OR,
+    OP_ERROR, OP_END
+} VmOp;
+
+typedef struct {
+    unsigned char op;
+    unsigned short argc;     /* Arguments popped by OP_ELEM / OP_CALL */
+    unsigned short tok;      /* Function (OP_CALL) or operator token */
+    int slot;                /* OP_VAR variable slot */
+    union {
+        double num;          /* OP_NUM */
+        int64_t i;           /* OP_INT */
+        String *lit;         /* OP_STR literal */
+        const char *str;     /* OP_ERROR message */
+        Token *name;         /* OP_ELEM identifier */
+    } u;
+} VmInsn;
+
+struct VmCode {
+    Token *after;   /* First token after the expression */
+    int max_stack;
+    int count;
+    VmInsn insns[1];
+};
+
+/* What the compiler knows about the type of an operand. K_ILIT is an
+   integer literal small enough to be exact as a number, pushed by the last
+   instruction emitted, so the operator after it can still choose how to
+   push it. */
+typedef enum { K_ANY, K_NUM, K_INT, K_STR, K_ILIT } Kind;
+
+/* Compiler state */
+static VmInsn *cbuf = NULL;
+static int ccount = 0;
+static int ccap = 0;
+static int cdepth = 0;
+static int cmax_depth = 0;
+static Token *cp = NULL;    /* Compile cursor */
+static int cfailed = 0;     /* A syntax error was emitted; the rest is unreachable */
+
+static Kind c_expr(void);
+
+static void emit(VmOp op, BasTokenType tok, int argc, int effect) {
+    VmInsn *in;
+    if (ccount >= ccap) {
+        ccap = ccap ? ccap * 2 : 64;
+        cbuf = realloc(cbuf, ccap * sizeof(VmInsn));
+        if (!cbuf) error("Out of memory");
+    }
+    in = &cbuf[ccount++];
+    in->op = (unsigned char)op;
+    in->argc = (unsigned short)argc;
+    in->tok = (unsigned short)tok;
+    in->slot = 0;
+    in->u.num = 0.0;
+    cdepth += effect;
+    if (cdepth > cmax_depth) cmax_depth = cdepth;
+}
+
+static void c_error(const char *msg) {
+    if (!cfailed) {
+        emit(OP_ERROR, TOK_NONE, 0, 0);
+        cbuf[ccount - 1].u.str = msg;
+    }
+    cfailed = 1;
+}
+
+static BasTokenType peek(void) {
+    return cfailed ? TOK_EOL : cp->type;
+}
+
+static void advance(void) {
+    if (cp->type != TOK_EOL) cp++;
+    /* The tree-walker raises lexing errors as soon as it reads the token */
+    if (cp->type == TOK_ERROR) c_error(cp->str);
+}
+
+static int accept(BasTokenType t) {
+    if (peek() == t) {
+        advance();
+        return 1;
+    }
+    return 0;
+}
+
+static int is_int_kind(Kind k) {
+    return k == K_INT || k == K_ILIT;
+}
+
+/* Turn the number literal at cbuf[pos] into an integer */
+static void c_literal_to_int(int pos) {
+    if (cbuf[pos].op == OP_NUM) {
+        cbuf[pos].op = OP_INT;
+        cbuf[pos].u.i = (int64_t)cbuf[pos].u.num;
+    }
+}
+
+/* Emit the operator tok for operands of kinds left and right; left_pos is
+   the instruction that pushed the left operand if that is K_ILIT. An
+   integer literal is pushed as a number, but meeting an integer it would
+   be converted on every run (I% + 1), so it is made an integer here
+   instead. Returns the kind of the result. */
+static Kind c_binary(BasTokenType tok, Kind left, int left_pos, Kind right) {
+    VmOp op;
+    Kind kind;
+
+    if (left == K_ILIT && right == K_INT) c_literal_to_int(left_pos);
+    if (right == K_ILIT && left == K_INT) c_literal_to_int(ccount - 1);
+
+    if ((left == K_INT && is_int_kind(right)) || (right == K_INT && is_int_kind(left))) kind = K_INT;
+    else if (left == K_STR && right == K_STR) kind = K_STR;
+    else if ((left == K_NUM || is_int_kind(left)) && (right == K_NUM || is_int_kind(right))) kind = K_NUM;
+    else kind = K_ANY;
+
+    switch (tok) {
+        case TOK_PLUS: op = OP_ADD; break;
+        case TOK_MINUS: op = OP_SUB; break;
+        case TOK_MUL: op = OP_MUL; break;
+        case TOK_DIV: op = OP_DIV; break;
+        case TOK_MOD: op = OP_MOD; break;
+        case TOK_EQ: op = OP_EQ; break;
+        case TOK_NE: op = OP_NE; break;
+        case TOK_LT: op = OP_LT; break;
+        case TOK_GT: op = OP_GT; break;
+        case TOK_LE: op = OP_LE; break;
+        case TOK_GE: op = OP_GE; break;
+        case TOK_AND: op = OP_AND; break;
+        default: op = OP_OR; break;
+    }
+    emit(op, tok, 0, -1);
+
+    /* Comparisons, AND, OR and / always give numbers; the rest keep kind */
+    if (op == OP_DIV || op >= OP_EQ) return K_NUM;
+    return kind;
+}
+
+static Kind c_factor(void) {
+    BasTokenType t = peek();
+    Kind kind = K_NUM;
+
+    if (t == TOK_NUMBER) {
+        if (cp->is_int && cp->ival > INT_EXACT_MAX) {
+            emit(OP_INT, t, 0, 1);
+            cbuf[ccount - 1].u.i = cp->ival;
+            kind = K_INT;
+        } else {
+            emit(OP_NUM, t, 0, 1);
+            cbuf[ccount - 1].u.num = cp->num;
+            if (cp->is_int) kind = K_ILIT;
+        }
+        advance();
+    } else if (t == TOK_STRING) {
+        /* Made once here and shared by every evaluation */
+        emit(OP_STR, t, 0, 1);
+        cbuf[ccount - 1].u.lit = str_new(cp->str, strlen(cp->str));
+        kind = K_STR;
+        advance();
+    } else if (t == TOK_IDENTIFIER) {
+        Token *id = cp;
+        const char *name = cp->str;
+        advance();
+        if (accept(TOK_LPAREN)) {
+            /* FN call or array element; which one is decided at run time
+               by load_element(), exactly as the tree-walker does. */
+            int is_fn_name = (id->fn >= 0);
+            int nargs = 0;
+            do {
+                if (nargs >= 0xFFFF) {
+                    c_error("Too many subscripts");
+                    break;
+                }
+                c_expr();
+                nargs++;
+            } while (accept(TOK_COMMA));
+            if (!accept(TOK_RPAREN)) c_error(is_fn_name ? "Expected ')' for FN" : "Expected ')'");
+            emit(OP_ELEM, t, nargs, 1 - nargs);
+            cbuf[ccount - 1].u.name = id;
+            if (is_fn_name) kind = K_ANY;
+            else if (strchr(name, '$')) kind = K_STR;
+            else if (strchr(name, '%')) kind = K_INT;
+        } else {
+            int slot = resolve_var(id);
+            emit(OP_VAR, t, 0, 1);
+            cbuf[ccount - 1].slot = slot;
+            if (variables[slot].type == VAL_STR) kind = K_STR;
+            else if (variables[slot].type == VAL_INT) kind = K_INT;
+        }
+    } else if (t == TOK_LPAREN) {
+        advance();
+        kind = c_expr();
+        if (!accept(TOK_RPAREN)) c_error("Missing ')'");
+    } else if (t == TOK_MINUS) {
+        advance();
+        kind = c_factor();
+        if (kind == K_ILIT && cbuf[ccount - 1].op == OP_NUM) {
+            cbuf[ccount - 1].u.num = -cbuf[ccount - 1].u.num; /* A negative literal */
+        } else {
+            emit(OP_NEG, t, 0, 0);
+            if (kind == K_ILIT) kind = K_NUM;
+        }
+    } else if (t == TOK_PLUS) {
+        advance();
+        kind = c_factor(); /* Unary plus, do nothing */
+    } else if (t == TOK_INKEY) {
+        advance();
+        emit(OP_CALL, t, 0, 1);
+        kind = K_STR;
+    } else if (t >= TOK_LEN && t <= TOK_STR) {
+        int nargs = 1;
+        advance();
+        if (!accept(TOK_LPAREN)) c_error(string_fn_message(t, SFN_LPAREN));
+        c_expr();
+        if (t == TOK_MID || t == TOK_LEFT || t == TOK_RIGHT) {
+            if (!accept(TOK_COMMA)) c_error(string_fn_message(t, SFN_COMMA));
+            c_expr();
+            nargs++;
+            if (t == TOK_MID && accept(TOK_COMMA)) {
+                c_expr();
+                nargs++;
+            }
+        }
+        emit(OP_CALL, t, nargs, 1 - nargs);
+        if (!accept(TOK_RPAREN)) c_error(string_fn_message(t, SFN_RPAREN));
+        if (t != TOK_LEN && t != TOK_ASC && t != TOK_VAL) kind = K_STR;
+    } else if (t >= TOK_SIN && t <= TOK_RND) {
+        advance();
+        if (!accept(TOK_LPAREN)) c_error("Expected '(' for function");
+        c_expr();
+        if (!accept(TOK_RPAREN)) c_error("Missing ')' for function");
+        emit(OP_CALL, t, 1, 0);
+    } else {
+        c_error("Expected number, variable, or function");
+        kind = K_ANY;
+    }
+    return kind;
+}
+
+static Kind c_term(void) {
+    Kind kind = c_factor();
+    while (peek() == TOK_MUL || peek() == TOK_DIV || peek() == TOK_MOD) {
+        BasTokenType op = peek();
+        int left_pos = ccount - 1;
+        advance();
+        kind = c_binary(op, kind, left_pos, c_factor());
+    }
+    return kind;
+}
+
+static Kind c_additive(void) {
+    Kind kind = c_term();
+    while (peek() == TOK_PLUS || peek() == TOK_MINUS) {
+        BasTokenType op = peek();
+        int left_pos = ccount - 1;
+        advance();
+        kind = c_binary(op, kind, left_pos, c_term());
+    }
+    return kind;
+}
+
+static Kind c_relation(void) {
+    Kind kind = c_additive();
+    while (peek() == TOK_EQ || peek() == TOK_NE || peek() == TOK_LT ||
+           peek() == TOK_GT || peek() == TOK_LE || peek() == TOK_GE) {
+        BasTokenType op = peek();
+        int left_pos = ccount - 1;
+        advance();
+        kind = c_binary(op, kind, left_pos, c_additive());
+    }
+    return kind;
+}
+
+static Kind c_not(void) {
+    if (peek() == TOK_NOT) {
+        advance();
+        c_not();
+        emit(OP_NOT, TOK_NOT, 0, 0);
+        return K_NUM;
+    }
+    return c_relation();
+}
+
+static Kind c_and(void) {
+    Kind kind = c_not();
+    while (peek() == TOK_AND) {
+        int left_pos = ccount - 1;
+        advance();
+        kind = c_binary(TOK_AND, kind, left_pos, c_not());
+    }
+    return kind;
+}
+
+static Kind c_expr(void) {
+    Kind kind = c_and();
+    while (peek() == TOK_OR) {
+        int left_pos = ccount - 1;
+        advance();
+        kind = c_binary(TOK_OR, kind, left_pos, c_and());
+    }
+    return kind;
+}
+
+static struct VmCode *compile(Token *start) {
+    struct VmCode *code;
+
+    cp = start;
+    ccount = 0;
+    cdepth = 0;
+    cmax_depth = 0;
+    cfailed = 0;
+
+    c_expr();
+    emit(OP_END, TOK_NONE, 0, 0);
+
+    code = malloc(sizeof(struct VmCode) + (ccount - 1) * sizeof(VmInsn));
+    if (!code) error("Out of memory");
+    code->after = cp;
+    code->max_stack = cmax_depth;
+    code->count = ccount;
+    memcpy(code->insns, cbuf, ccount * sizeof(VmInsn));
+    return code;
+}
+
+void vm_free_code(struct VmCode *code) {
+    int i;
+    for (i = 0; i < code->count; i++) {
+        if (code->insns[i].op == OP_STR) str_unref(code->insns[i].u.lit);
+    }
+    free(code);
+}
+
+#if VM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#endif
+#define VM_DISPATCH()  goto *dispatch[ip->op];
+#define VM_CASE(op)    L_##op:
+#define VM_NEXT()      goto *dispatch[(++ip)->op]
+#else
+#define VM_DISPATCH()  for (;;) switch (ip->op)
+#define VM_CASE(op)    case op:
+#define VM_NEXT()      { ip++; continue; }
+#endif
+
+/* Numeric fast path for a binary operator, falling back to apply_binary() */
+#define VM_ARITH(expr) \
+    if (VAL_TYPE(sp[-2]) == VAL_NUM && VAL_TYPE(sp[-1]) == VAL_NUM) { \
+        expr; \
+    } else { \
+        sp[-2] = apply_binary((BasTokenType)ip->tok, sp[-2], sp[-1]); \
+    } \
+    sp--; \
+    VM_NEXT()
+
+/* Integer fast path, taken when both operands are integers and the result
+   fits; otherwise the operator falls through to the general case */
+#define VM_INT_ARITH(overflows, result) \
+    if (VAL_TYPE(sp[-2]) == VAL_INT && VAL_TYPE(sp[-1]) == VAL_INT) { \
+        int64_t a = INT_OF(sp[-2]), b = INT_OF(sp[-1]); \
+        if (!(overflows)) { \
+            SET_INT(sp[-2], result); \
+            sp--; \
+            VM_NEXT(); \
+        } \
+    }
+
+#define VM_COMPARE(cmp) \
+    if (VAL_TYPE(sp[-2]) == VAL_INT && VAL_TYPE(sp[-1]) == VAL_INT) { \
+        SET_NUM(sp[-2], (INT_OF(sp[-2]) cmp INT_OF(sp[-1])) ? -1.0 : 0.0); \
+        sp--; \
+        VM_NEXT(); \
+    } \
+    VM_ARITH(sp[-2].num = (sp[-2].num cmp sp[-1].num) ? -1.0 : 0.0)
+
+static Value vm_run(const struct VmCode *code) {
+    Value inline_stack[VM_INLINE_STACK];
+    Value *stack = inline_stack;
+    Value *sp;
+    const VmInsn *ip = code->insns;
+#if VM_COMPUTED_GOTO
+    static const void *const dispatch[] = {
+        &&L_OP_NUM, &&L_OP_INT, &&L_OP_STR, &&L_OP_VAR, &&L_OP_ELEM, &&L_OP_CALL,
+        &&L_OP_NEG, &&L_OP_NOT,
+        &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MOD,
+        &&L_OP_EQ, &&L_OP_NE, &&L_OP_LT, &&L_OP_GT, &&L_OP_LE, &&L_OP_GE,
+        &&L_OP_AND, &&L_OP_OR,
+        &&L_OP_ERROR, &&L_OP_END
+    };
+#endif
+
+    if (code->max_stack > VM_INLINE_STACK) {
+        stack = temp_alloc(code->max_stack * sizeof(Value));
+    }
+    sp = stack;
+
+    VM_DISPATCH() {
+        VM_CASE(OP_NUM)
+            SET_NUM(*sp, ip->u.num);
+            sp++;
+            VM_NEXT();
+        VM_CASE(OP_INT)
+            SET_INT(*sp, ip->u.i);
+            sp++;
+            VM_NEXT();
+        VM_CASE(OP_STR)
+            *sp = str_share(ip->u.lit);
+            sp++;
+            VM_NEXT();
+        VM_CASE(OP_VAR)
+            *sp = get_var(ip->slot);
+            sp++;
+            VM_NEXT();
+        VM_CASE(OP_ELEM)
+            sp -= ip->argc;
+            *sp = load_element(ip->u.name, sp, ip->argc);
+            sp++;
+            VM_NEXT();
+        VM_CASE(OP_CALL)
+            sp -= ip->argc;
+            *sp = apply_builtin((BasTokenType)ip->tok, sp, ip->argc);
+            sp++;
+            VM_NEXT();
+        VM_CASE(OP_NEG)
+            if (VAL_TYPE(sp[-1]) == VAL_NUM) sp[-1].num = -sp[-1].num;
+            else sp[-1] = apply_unary(TOK_MINUS, sp[-1]);
+            VM_NEXT();
+        VM_CASE(OP_NOT)
+            sp[-1] = apply_unary(TOK_NOT, sp[-1]);
+            VM_NEXT();
+        VM_CASE(OP_ADD)
+            VM_INT_ARITH(b > 0 ? a > INT64_MAX - b : a < INT64_MIN - b, a + b);
+            VM_ARITH(sp[-2].num += sp[-1].num);
+        VM_CASE(OP_SUB)
+            VM_INT_ARITH(b < 0 ? a > INT64_MAX + b : a < INT64_MIN + b, a - b);
+            VM_ARITH(sp[-2].num -= sp[-1].num);
+        VM_CASE(OP_MUL)
+            VM_INT_ARITH(int_mul_overflows(a, b), a * b);
+            VM_ARITH(sp[-2].num *= sp[-1].num);
+        VM_CASE(OP_DIV)
+            if (VAL_TYPE(sp[-1]) == VAL_NUM && sp[-1].num == 0.0) {
+                sp[-2] = apply_binary(TOK_DIV, sp[-2], sp[-1]); /* Reports the error */
+                sp--;
+                VM_NEXT();
+            }
+            VM_ARITH(sp[-2].num /= sp[-1].num);
+        VM_CASE(OP_MOD)
+            VM_INT_ARITH(b == 0, b == -1 ? 0 : a % b); /* apply_binary() reports / 0 */
+            sp[-2] = apply_binary(TOK_MOD, sp[-2], sp[-1]);
+            sp--;
+            VM_NEXT();
+        VM_CASE(OP_EQ)
+            VM_COMPARE(==);
+        VM_CASE(OP_NE)
+            VM_COMPARE(!=);
+        VM_CASE(OP_LT)
+            VM_COMPARE(<);
+        VM_CASE(OP_GT)
+            VM_COMPARE(>);
+        VM_CASE(OP_LE)
+            VM_COMPARE(<=);
+        VM_CASE(OP_GE)
+            VM_COMPARE(>=);
+        VM_CASE(OP_AND)
+            sp[-2] = apply_binary(TOK_AND, sp[-2], sp[-1]);
+            sp--;
+            VM_NEXT();
+        VM_CASE(OP_OR)
+            sp[-2] = apply_binary(TOK_OR, sp[-2], sp[-1]);
+            sp--;
+            VM_NEXT();
+        VM_CASE(OP_ERROR)
+            error(ip->u.str);
+            VM_NEXT();
+        VM_CASE(OP_END)
+            goto done;
+    }
+
+done:
+    return sp[-1];
+}
+
+#if VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+Value vm_expression(void) {
+    /* current_token was read from the token just before token_ptr,
+       except at the end of the line where the stream does not advance. */
+    Token *start = (current_token == TOK_EOL) ? token_ptr : token_ptr - 1;
+    struct VmCode *code = start->code;
+    Value result;
+
+    if (!code) {
+        code = compile(start);
+        start->code = code;
+    }
+
+    result = vm_run(code);
+
+    token_ptr = code->after;
+    next_token();
+    return result;
+}
@@ -0,0 +1,15 @@
+10 PRINT "FIRST 10"
+30 PRINT "LINE 30"
+20 PRINT "OLD 20"
+10 REM A line number given twice keeps its last definition
+20 PRINT "NEW 20"
+40 GOTO 60
+50 PRINT "NEVER"
+60 DATA 1, 2
+60 DATA 3, 4
+70 READ A, B: PRINT A; " "; B
+80 GOSUB 100
+90 END
+100 PRINT "OLD 100": RETURN
+25 PRINT "LINE 25"
+100 PRINT "NEW 100": RETURN
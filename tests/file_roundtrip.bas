@@ -0,0 +1,21 @@
+10 REM What PRINT # writes, INPUT # reads back
+20 OPEN "file_roundtrip.tmp" FOR OUTPUT AS #1
+30 PRINT #1, 1, 2
+40 PRINT #1, 1; 2; 3
+50 PRINT #1, -1.5; 2E-09; 123456789
+60 PRINT #1, "A B"; ","; 7
+70 A% = 9007199254740993: PRINT #1, A%; -A%
+80 PRINT #1, "NOT A NUMBER"
+90 CLOSE #1
+100 OPEN "file_roundtrip.tmp" FOR INPUT AS #1
+110 INPUT #1, A, B: PRINT A; " "; B
+120 INPUT #1, A, B, C: PRINT A; " "; B; " "; C
+130 INPUT #1, A, B, C: PRINT A; " "; B; " "; C
+140 INPUT #1, S$, N: PRINT S$; "|"; N
+150 INPUT #1, B%, C%: PRINT B%; " "; C%
+160 INPUT #1, X$: PRINT X$
+170 PRINT EOF(1)
+180 CLOSE #1
+190 OPEN "file_roundtrip.tmp" FOR INPUT AS #1
+200 FOR I = 1 TO 5: LINE INPUT #1, L$: NEXT I
+210 INPUT #1, N
@@ -0,0 +1,41 @@
+10 REM OPEN, PRINT #, INPUT #, LINE INPUT #, EOF and LOF, buffered and MAPPED
+20 S$ = "0123456789ABCDEF"
+30 FOR I = 1 TO 17: S$ = S$ + S$: NEXT I
+40 PRINT "Long line:"; LEN(S$)
+50 OPEN "files.tmp" FOR OUTPUT AS #1
+60 PRINT #1, "FIRST LINE"
+70 PRINT #1, S$; ","; "TAIL"
+80 PRINT #1, 1; 2.5; -3
+90 PRINT #1, "LAST"
+100 CLOSE #1
+110 OPEN "files.tmp" FOR APPEND AS #2
+120 PRINT #2, "APPENDED"
+130 CLOSE #2
+140 M$ = "": GOSUB 1000
+150 M$ = " MAPPED": GOSUB 1000
+160 REM An empty file
+170 OPEN "empty.tmp" FOR OUTPUT AS #1: CLOSE #1
+180 OPEN "empty.tmp" FOR INPUT AS #1 MAPPED
+190 PRINT "Empty:"; LOF(1); " "; EOF(1)
+200 CLOSE
+210 END
+1000 REM Read files.tmp back, buffered or mapped
+1010 IF M$ = "" THEN OPEN "files.tmp" FOR INPUT AS #1
+1020 IF M$ <> "" THEN OPEN "files.tmp" FOR INPUT AS #1 MAPPED
+1030 PRINT "Reading"; M$; ", LOF"; LOF(1)
+1040 LINE INPUT #1, L$: PRINT L$
+1050 LINE INPUT #1, L$: PRINT LEN(L$); " "; RIGHT$(L$, 6); " "; L$ = S$ + ",TAIL"
+1060 INPUT #1, A, B, C: PRINT A; " "; B; " "; C
+1070 LINE INPUT #1, L$: PRINT L$; " "; EOF(1)
+1080 LINE INPUT #1, L$: PRINT L$; " "; EOF(1)
+1090 CLOSE #1
+1100 IF M$ = "" THEN OPEN "files.tmp" FOR INPUT AS #1
+1110 IF M$ <> "" THEN OPEN "files.tmp" FOR INPUT AS #1 MAPPED
+1120 INPUT #1, F$, X$, T$: PRINT F$; " "; LEN(X$); " "; X$ = S$; " "; T$
+1130 N = 0
+1140 IF EOF(1) THEN 1170
+1150 LINE INPUT #1, L$: N = N + 1
+1160 GOTO 1140
+1170 PRINT N; " more lines"
+1180 CLOSE #1
+1190 RETURN
@@ -0,0 +1,31 @@
+10 REM FOR counters of each kind, rising and falling
+20 FOR I = 1 TO 5: PRINT I; " "; : NEXT I: PRINT
+30 FOR I = 5 TO 1 STEP -1: PRINT I; " "; : NEXT I: PRINT
+40 FOR I = 0 TO 1 STEP 0.25: PRINT I; " "; : NEXT I: PRINT
+50 FOR I = 1 TO 0 STEP -0.5: PRINT I; " "; : NEXT I: PRINT
+60 FOR I% = 1 TO 10 STEP 3: PRINT I%; " "; : NEXT I%: PRINT
+70 FOR I% = 10 TO 1 STEP -4: PRINT I%; " "; : NEXT: PRINT
+80 FOR I% = 9007199254740990 TO 9007199254740993: PRINT I%; " "; : NEXT I%: PRINT
+90 FOR I! = 0 TO 1 STEP 0.5: PRINT I!; " "; : NEXT I!: PRINT
+100 FOR I! = 1 TO 0 STEP -0.25: PRINT I!; " "; : NEXT I!: PRINT
+110 REM The counter after the loop; the body runs once even past the limit
+120 FOR I = 1 TO 3: NEXT I: PRINT "After:"; I
+130 FOR I% = 1 TO 3: NEXT I%: PRINT "After:"; I%
+140 FOR I = 5 TO 1: PRINT "Once,"; : NEXT I: PRINT " I ="; I
+150 REM Nested loops on one line, and statements after NEXT
+160 FOR I = 1 TO 3: FOR J = 1 TO 2: PRINT I * 10 + J; " "; : NEXT J: NEXT I: PRINT
+170 FOR I = 1 TO 3: NEXT I: PRINT "Once"
+180 REM The limit and step are read once
+190 N = 3: FOR I = 1 TO N: N = 10: PRINT I; " "; : NEXT I: PRINT
+200 FOR I = 1 TO 10
+210 IF I = 4 THEN I = 9
+220 PRINT I; " ";
+230 NEXT I
+240 PRINT
+250 REM A loop body that ends its line
+260 FOR K = 1 TO 2
+270 FOR L% = 3 TO 1 STEP -1
+280 PRINT K; L%; " ";
+290 NEXT L%
+300 NEXT K
+310 PRINT
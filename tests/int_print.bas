@@ -0,0 +1,17 @@
+10 REM Integer (%) values print with every digit
+20 A% = 3000000000: B% = 1234567: C% = 1234567890123
+30 PRINT A%; " "; B%; " "; C%; " "; -A%
+40 PRINT STR$(A%); " "; STR$(B%); " "; STR$(C%)
+50 OPEN "int_print.tmp" FOR OUTPUT AS #1
+60 PRINT #1, A%; ","; B%; ","; C%
+70 CLOSE #1
+80 OPEN "int_print.tmp" FOR INPUT AS #1
+90 LINE INPUT #1, L$
+100 CLOSE #1
+110 PRINT L$
+120 REM Numbers without % stay numbers, however they are written
+130 X = 100000 * 100000: PRINT 100000 * 100000; " "; X
+140 PRINT 3000000000; " "; 3E9; " "; 2147483648 * 2; " "; 2147483648 + 2147483648
+150 REM Integer literals beyond 2^53 are exact
+160 A% = 9007199254740993: PRINT A%; " "; A% + 1; " "; A% * 3
+170 B% = 3037000499: PRINT B% * B%; " "; (B% + 1) * (B% + 1); " "; B% * 2
@@ -0,0 +1,13 @@
+10 REM Numbers print with the fewest digits that read back the same
+20 PRINT 0.1; " "; 1 / 3; " "; 2 / 3; " "; 0.1 + 0.2; " "; -0.5
+30 PRINT 1E15 + 0.5; " "; 1E16; " "; 1E17 / 3; " "; 1.5E-7; " "; 0.0001; " "; 0.00001234
+40 PRINT 5E-324; " "; 1.7976931348623157E308; " "; 2.2250738585072014E-308; " "; -1E100
+50 PRINT 3.14159265358979; " "; 12345.678; " "; SQR(2); " "; 1E21
+60 A! = 1 / 3: PRINT A!; " "; STR$(1 / 8); " "; STR$(-1E-5)
+70 REM The text reads back as the same number
+80 FOR I = 1 TO 1000
+90 X = RND(1) * EXP(LOG(10) * INT(RND(1) * 40 - 20))
+100 IF VAL(STR$(X)) <> X THEN PRINT "Mismatch: "; X
+110 NEXT I
+120 READ D$: PRINT D$
+130 DATA 0.30000000000000004
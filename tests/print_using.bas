@@ -0,0 +1,23 @@
+10 REM PRINT USING fields
+20 PRINT USING "###.##"; 3.14159; 0; -2.5
+30 PRINT USING "#,###.##"; 1234.5; 1234567.891
+40 PRINT USING "+###"; 5; -5
+50 PRINT USING "###+"; 5; -5
+60 PRINT USING "###-"; 5; -5
+70 PRINT USING "$$###.##"; 9.5; -9.5
+80 PRINT USING "**###.##"; 12.3
+90 PRINT USING "**$###.##"; 12.3
+100 PRINT USING "##.##^^^^"; 12345; 0.000123
+110 PRINT USING "##"; 123; -10
+120 PRINT USING "!"; "HELLO"
+130 PRINT USING "\  \|"; "HELLO"; "HI"
+140 PRINT USING "&!"; "WHOLE"
+150 PRINT USING "_####"; 42
+160 PRINT USING "A=## B=##"; 1; 2; 3; 4
+170 PRINT USING "\  \ $$###.##"; "TOTAL"; 9.5
+180 REM Halves round away from zero
+190 PRINT USING "#.#"; 0.25; 0.35; -0.25; 1.45
+200 PRINT USING "##"; 0.5; 1.5; 2.5; -2.5
+210 PRINT USING "#.##"; 1.005; 2.675; 0.125
+220 PRINT USING "#.#^^^^"; 25; 35; -0.00125
+230 PRINT USING "###.##"; 1; : PRINT " END"
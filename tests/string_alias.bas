@@ -0,0 +1,26 @@
+10 REM Appending a string to itself, and views that share a string
+20 A$ = "AB": A$ = A$ + A$: A$ = A$ + A$: PRINT A$
+30 A$ = A$ + MID$(A$, 2, 3): PRINT A$
+40 L$ = "A LONGER STRING THAN FITS INLINE"
+50 L$ = L$ + L$: PRINT L$
+60 L$ = L$ + RIGHT$(L$, 6): PRINT L$
+70 REM A view keeps its text when the string it came from grows
+80 S$ = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG"
+90 V$ = MID$(S$, 5, 5): W$ = LEFT$(S$, 3): X$ = RIGHT$(S$, 3)
+100 FOR I = 1 TO 20: S$ = S$ + "!": NEXT I
+110 PRINT V$; "|"; W$; "|"; X$; "|"; LEN(S$)
+120 S$ = "REPLACED": PRINT V$; "|"; W$; "|"; X$
+130 REM Appending to a view copies it rather than writing into its string
+140 T$ = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+150 U$ = LEFT$(T$, 10): U$ = U$ + "**": PRINT U$; " "; T$
+160 U$ = MID$(T$, 11, 5): U$ = U$ + U$: PRINT U$; " "; T$
+170 REM A view is not terminated: VAL stops at its end
+180 N$ = "12345678901234567890": PRINT VAL(MID$(N$, 3, 4)); " "; VAL(LEFT$(N$, 2))
+190 REM Views stored in an array keep their text
+200 DIM C$(5)
+210 FOR I = 1 TO 5: C$(I) = MID$(T$, I * 3, 3): NEXT I
+220 T$ = "": FOR I = 1 TO 5: PRINT C$(I); " "; : NEXT I: PRINT
+230 C$(1) = C$(1) + C$(1): C$(2) = C$(2) + C$(1): PRINT C$(1); " "; C$(2)
+240 REM A view of a view
+250 Y$ = MID$(MID$("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789", 5, 20), 3, 5): PRINT Y$
+260 Y$ = Y$ + LEFT$(Y$, 2) + Y$: PRINT Y$
@@ -0,0 +1,66 @@
+#!/bin/bash
+set -e
+
+# Compares the two Value layouts: builds the interpreter once as usual and
+# once with NANBOX=1, then times both on a numeric and a string workload.
+
+# --- Configuration ---
+readonly RUNS=3
+
+# --- Script ---
+readonly TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+build() {
+    make -s TARGET="$TMP_DIR/$1" "${@:2}" > /dev/null 2>&1 || {
+        echo "Failed to build $1"
+        exit 1
+    }
+}
+build basic-struct
+build basic-nanbox NANBOX=1
+
+cat > "$TMP_DIR/numeric.bas" << 'EOF'
+10 DIM A(1000)
+20 FOR I = 1 TO 1000: A(I) = I: NEXT I
+30 S = 0
+40 FOR J = 1 TO 300
+50 FOR I = 1 TO 1000
+60 S = S + A(I) * 2 - J / 3
+70 NEXT I
+80 NEXT J
+90 PRINT S
+EOF
+
+cat > "$TMP_DIR/string.bas" << 'EOF'
+10 S$ = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG": N = 0
+20 DIM W$(100)
+30 FOR J = 1 TO 2000
+40 FOR I = 1 TO LEN(S$)
+50 C$ = MID$(S$, I, 1)
+60 IF C$ = "O" THEN N = N + 1
+70 NEXT I
+80 W$(J - INT(J / 100) * 100) = LEFT$(S$, 10) + STR$(J) + RIGHT$(S$, 10)
+90 NEXT J
+100 PRINT N; W$(0)
+EOF
+
+# Best wall-clock time of $RUNS runs, in milliseconds
+best_ms() {
+    local best="" start end ms i
+    for ((i = 0; i < RUNS; i++)); do
+        start=$(date +%s%N)
+        "$1" "$2" > /dev/null
+        end=$(date +%s%N)
+        ms=$(((end - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then best=$ms; fi
+    done
+    echo "$best"
+}
+
+printf "%-10s %12s %12s\n" "workload" "struct (ms)" "nanbox (ms)"
+for workload in numeric string; do
+    printf "%-10s %12s %12s\n" "$workload" \
+        "$(best_ms "$TMP_DIR/basic-struct" "$TMP_DIR/$workload.bas")" \
+        "$(best_ms "$TMP_DIR/basic-nanbox" "$TMP_DIR/$workload.bas")"
+done
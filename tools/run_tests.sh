@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Runs every tests/*.bas with the interpreter given as $1, under both the
+# bytecode VM and the tree-walker (--tree), and compares what it prints
+# with tests/NAME.out. Tests run inside tests/, so any files they write
+# stay there.
+
+# --- Configuration ---
+readonly BASIC=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+readonly TEST_DIR=$(cd "$(dirname "$0")/../tests" && pwd)
+
+# --- Script ---
+failed=0
+cd "$TEST_DIR" || exit 1
+for test in *.bas; do
+    name=${test%.bas}
+    for engine in vm tree; do
+        if [ "$engine" = tree ]; then
+            output=$("$BASIC" --tree "$test" 2>&1 < /dev/null)
+        else
+            output=$("$BASIC" "$test" 2>&1 < /dev/null)
+        fi
+        if [ "$output" = "$(cat "$name.out")" ]; then
+            echo "PASS $name ($engine)"
+        else
+            echo "FAIL $name ($engine)"
+            diff <(echo "$output") "$name.out"
+            failed=1
+        fi
+    done
+done
+rm -f ./*.tmp
+exit $failed